@@ -1,18 +1,44 @@
 #include <regex>
 #include <random>
 #include <algorithm>
+#include <bitset>
 #include <iostream>
 #include <memory>
+#include <cassert>
 #include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstdint>
 #include <deque>
+#include <functional>
+#include <iterator>
 #include <map>
 #include <set>
+#include <vector>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory_resource>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <charconv>
+#include <climits>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "printf.hh"
 
-static std::mt19937 rnd;
-
 // frand() generates a random number between 0 and 1.
+// These draw from whatever random number generator is called "rnd" in scope.
 #define frand()    std::uniform_real_distribution<>(0.f, 1.f)(rnd)
 // Generate a random number of specified range.
 #define rand(size) std::uniform_int_distribution<>(0, (size)-1)(rnd)
@@ -23,56 +49,117 @@ constexpr std::size_t count(const T(&) [size])
     return size;
 }
 
+// Compile a regular expression only once. Every distinct pattern
+// is compiled on first use and kept in a registry for later calls.
+// Each thread has a registry of its own, so no locking is needed.
+static const std::regex& Regex(std::string_view pattern)
+{
+    static thread_local std::unordered_map<std::string_view, std::regex> registry;
+    static thread_local std::deque<std::string> keys; // Backing storage for the views above
+    auto i = registry.find(pattern);
+    if(i == registry.end())
+    {
+        keys.emplace_back(pattern);
+        i = registry.emplace(keys.back(), std::regex(keys.back())).first;
+    }
+    return i->second;
+}
+
 // Syntactic shorthand for creating regular expressions.
-static std::regex operator ""_r(const char* pattern, std::size_t length)
+static const std::regex& operator ""_r(const char* pattern, std::size_t length)
 {
-    return std::regex(pattern,length);
+    return Regex({pattern,length});
 }
 
+// Memory for the strings and lists that are needed only while one command
+// is carried out. All of it is given back at once when the command is done
+// (see Game::Run()), so nothing allocated from it may be kept any longer.
+struct Scratch
+{
+    alignas(std::max_align_t) char initial[1 << 15];
+    std::pmr::monotonic_buffer_resource resource{initial, sizeof(initial)};
+} static thread_local scratch;
+typedef std::pmr::string               ScratchString;
+typedef std::pmr::deque<ScratchString> ScratchList;
+
 
 
-// English language word manipulations:
-static std::string RemoveArticle(const std::string& s)
+// English language word manipulations.
+// These work on string views and append the result into a buffer
+// given by the caller, so that a buffer can be reused between calls.
+
+static bool IsWordChar(char c)
+{
+    return std::isalnum((unsigned char)c) || c == '_';
+}
+
+// Length of the article in the beginning of s ("a", "an" or "the",
+// including the spaces after it), or 0 if there is none.
+static std::size_t ArticleLength(std::string_view s)
 {
-    return std::regex_replace(s, "^(?:a|an|the) +"_r, "");
+    for(std::string_view a: { "a", "an", "the" })
+        if(s.size() > a.size() && s.compare(0, a.size(), a) == 0 && s[a.size()] == ' ')
+            return std::min(s.find_first_not_of(' ', a.size()), s.size());
+    return 0;
 }
 
-static std::string Pluralize(const std::string& s)
+static std::string_view RemoveArticle(std::string_view s)
+{
+    return s.substr(ArticleLength(s));
+}
+
+template<typename String>
+static void AppendPlural(String& out, std::string_view s)
 {
     // Make the name plural by tacking a 's' at the right spot
     // which is usually in the end of the string, but always
-    // before any "of" or "made of".
-
-    // Put a placeholder "\001" there first, so we can use it
-    // later to decide the correct suffix depending on the word.
-    auto temp = std::regex_replace(
-        s,
-        R"(^(.*?)( (?:\(|of\b|made of\b).*)?$)"_r,
-        "$1" "\001" "$2");
+    // before any "(", "of" or "made of".
+    auto Follows = [s](std::size_t pos, std::string_view word)
+    {
+        return s.compare(pos, word.size(), word) == 0
+            && (pos+word.size() == s.size() || !IsWordChar(s[pos+word.size()]));
+    };
+    std::size_t end = 0;
+    while(end < s.size() && !(s[end] == ' ' && (s.compare(end+1, 1, "(") == 0
+                                             || Follows(end+1, "of")
+                                             || Follows(end+1, "made of"))))
+        ++end;
+    std::string_view word = s.substr(0, end), rest = s.substr(end);
 
     // The correct form of plural suffix depends on how the word ends.
     // This table handles most cases occurring in the game correctly.
     // It is by no means a complete reference for English inflection.
-    #define endswith(s)  std::regex_search(temp,  "(?:" s ")\001"_r)
-    #define replace(s,w) std::regex_replace(temp, "(?:" s ")\001"_r, w)
-    return
-        endswith("s")       ? temp                  // leggings, overalls
-      : endswith("y")       ? replace("y",   "ies") // berry
-      : endswith("o|sh|ss") ? replace("",    "es")  // dish, glass, potato
-      : endswith("ff?")     ? replace("ff?", "ves") // staff, wolf
-      :                       replace("",    "s");  // anything else
-    #undef endswith
-    #undef replace
-}
-
-static std::string AddArticle(const std::string& s, bool definite = false)
-{
-    std::string p = RemoveArticle(s);
-    if(definite) return "the " + p;
-    // Don't add "a" or "an" to a plural form
-    if(p == Pluralize(p)) return p;
+    auto EndsWith = [&word](std::string_view e)
+    {
+        return word.size() >= e.size() && word.compare(word.size()-e.size(), e.size(), e) == 0;
+    };
+    // Words ending in "s" are considered plural already. They get a "\001"
+    // in place of the suffix; the regex-based version left its placeholder
+    // there, and it is kept so that the output stays the same.
+    std::string_view suffix = "s";                                 // anything else
+    if(EndsWith("s"))                        suffix = "\001";      // leggings, overalls
+    else if(EndsWith("y"))                 { suffix = "ies"; word.remove_suffix(1); } // berry
+    else if(EndsWith("o") || EndsWith("sh")) suffix = "es";        // dish, potato
+    else if(EndsWith("f"))                 { suffix = "ves"; word.remove_suffix(EndsWith("ff") ? 2 : 1); } // staff, wolf
+    out.append(word).append(suffix).append(rest);
+}
+
+template<typename String>
+static void AppendWithArticle(String& out, std::string_view s, bool definite = false)
+{
+    std::string_view p = RemoveArticle(s);
+    // Plural forms would not take "a" or "an", but AppendPlural() changes
+    // every name, so no name is considered plural to begin with.
     // Add "an" if the word begins with a vowel, "a" otherwise.
-    return (std::regex_search(p, "^[aeiou]"_r) ? "an ":"a ") + p;
+    out.append(definite ? "the "
+               : (!p.empty() && std::string_view("aeiou").find(p[0]) != p.npos) ? "an " : "a ").append(p);
+}
+
+static std::string AddArticle(std::string_view s, bool definite = false)
+{
+    std::string result;
+    AppendWithArticle(result, s, definite);
+    return result;
 }
 
 static std::string UCfirst(const std::string& s)
@@ -84,49 +171,48 @@ static const char* const Numerals1to12[12-1+1] =
     { "one","two","three","four","five","six","seven",
       "eight","nine","ten","eleven","twelve" };
 
-static std::string ListWithCounts(std::deque<std::string>&& items, bool oneliner=true)
+static std::string ListWithCounts(ScratchList&& items, bool oneliner=true)
 {
-    // Count the number of times each item occurs
-    std::map<std::string, unsigned> count;
-    for(const auto& s: items) ++count[s];
-    // Now, deal with each item
-    for(size_t a=0; a<items.size(); ++a)
+    // Count the number of times each item occurs, keeping the items
+    // in the order in which they first occur.
+    std::pmr::unordered_map<std::string_view, std::size_t> index(&scratch.resource);
+    std::pmr::vector<std::pair<std::string_view, unsigned>> groups(&scratch.resource);
+    index.reserve(items.size());
+    for(const auto& s: items)
     {
-        std::string& n = items[a];
-        auto i = count.find(n);
-        // Was this item one of those duplicated ones?
-        if(i->second == 1) continue;
-        // Have we already dealt with it?
-        if(!i->second)
-        {
-            // Yes, delete it
-            items.erase( items.begin() + a-- );
-            continue;
-        }
-        // Remove possible indefinite article.
-        n = RemoveArticle(n);
-        // Add the count. Numbers 2-12 are expressed using an English word.
-        if(i->second <= 12) n = "%s %s"_f % Numerals1to12[i->second-1] % n;
-        else                n = "%u %s"_f % i->second % n;
-        n = Pluralize(n);
-        // Remember to not do the same item again
-        i->second = 0;
+        auto i = index.emplace(s, groups.size());
+        if(i.second) groups.emplace_back(s, 0);
+        ++groups[i.first->second].second;
     }
-    // Finally convert the list into text
+    // Then convert the list into text
     std::string output;
-    for(std::size_t a=0; a<items.size(); ++a)
-        if(oneliner)
+    ScratchString counted(&scratch.resource);
+    for(std::size_t a=0; a<groups.size(); ++a)
+    {
+        if(oneliner && a) output += (a+1==groups.size()) ? ", and " : ", ";
+        auto [name, n] = groups[a];
+        if(n == 1)
+            output += name;
+        else
         {
-            if(a) output += (a+1==items.size()) ? ", and " : ", ";
-            output += items[a];
+            // Add the count, without any indefinite article.
+            // Numbers 2-12 are expressed using an English word.
+            char number[16];
+            if(n <= 12) counted = Numerals1to12[n-1];
+            else        counted.assign(number, std::to_chars(number, number+sizeof(number), n).ptr);
+            counted.append(" ").append(RemoveArticle(name));
+            AppendPlural(output, counted);
         }
-        else
-            output += "%s\n"_f % items[a];
+        if(!oneliner) output += '\n';
+    }
     return output;
 }
 
 enum { Normal=64, Bold=128, ColorMask=63 };
-static const std::map<std::string, unsigned> ansi_features =
+// The tags that text given to Term may contain, such as `me`. Each is
+// a color (possibly Bold), or 0 for "the color is unknown" (so that the
+// next color is always set), or 1 for "flush the output".
+static constexpr struct { std::string_view name; unsigned code; } ansi_features[] =
 { {"dfl",     0},
   {"reset",  37|Normal},
   {"chest",  35|Normal},
@@ -139,52 +225,94 @@ static const std::map<std::string, unsigned> ansi_features =
   {"alert",  31|Bold},
   {"prompt", 37|Bold},
   {"flush",  1 } };
+static constexpr int AnsiFeature(std::string_view name)
+{
+    for(const auto& f: ansi_features) if(f.name == name) return f.code;
+    return -1;
+}
+static_assert(AnsiFeature("me") == (36|Bold) && AnsiFeature("flush") == 1 && AnsiFeature("x") < 0);
+
 /* Support for color terminals */
 struct Term
 {
     int color=37;
     bool bold=false, enabled=true;
-
-    std::string format(const std::string& what)
+    // All output is collected in "buffer". When buffered, it stays there
+    // until Output() takes it, and otherwise it is written out when the
+    // text asks for a flush (as the prompt does).
+    bool buffered=false;
+    std::string buffer;
+
+    ~Term() { Flush(); }
+
+    // Add text to the buffer, turning the tags in it into escape sequences.
+    // A tag is a name of lowercase letters between backticks; any other
+    // backtick is just text.
+    void Write(std::string_view what)
     {
-        static std::regex pat = "`([a-z]+)`|([^`]+|.)"_r;
-        std::string result;
-        std::smatch res;
-        for(auto b = what.begin(), e = what.end(); std::regex_search(b,e, res, pat); b = res[0].second)
-            if(res[2].length())
-                result += res[2];
-            else
+        for(std::size_t p = 0; p < what.size(); )
+        {
+            auto tick = what.find('`', p);
+            buffer.append(what.substr(p, tick - p));
+            if(tick == what.npos) break;
+            auto end = tick + 1;
+            while(end < what.size() && what[end] >= 'a' && what[end] <= 'z') ++end;
+            if(end == tick + 1 || end == what.size() || what[end] != '`')
+                { buffer += '`'; p = tick + 1; continue; }
+            switch(int c = AnsiFeature(what.substr(tick + 1, end - tick - 1)))
             {
-                auto i = ansi_features.find(res[1]);
-                if(i != ansi_features.end())
-                    switch(int c = i->second)
-                    {
-                        case 0: color = 0; break;
-                        case 1: std::cout << std::flush; break;
-                        default: result += SetColor( c&Bold, c&ColorMask );
-                    }
+                case -1: break;
+                case 0: color = 0; break;
+                case 1: Flush(); break;
+                default: SetColor( c&Bold, c&ColorMask );
             }
-        return result;
+            p = end + 1;
+        }
     }
 
-    Term& operator<< (const std::string& what)
+    Term& operator<< (std::string_view what)    { Write(what); return *this; }
+    Term& operator<< (const std::string& what) { return *this << std::string_view(what); }
+    Term& operator<< (const char* what)        { return *this << std::string_view(what); }
+    // Return what has been buffered, and empty the buffer.
+    std::string Output()
+    {
+        std::string result;
+        result.swap(buffer);
+        return result;
+    }
+    // Unless buffered, write out everything collected so far at once.
+    void Flush()
     {
-        std::cout << format(what);
-        return *this;
+        if(buffered || buffer.empty()) return;
+#ifdef __linux__
+        for(std::size_t done = 0; done < buffer.size(); )
+        {
+            ssize_t n = write(STDOUT_FILENO, buffer.data() + done, buffer.size() - done);
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0) break;
+            done += n;
+        }
+#else
+        std::cout.write(buffer.data(), buffer.size()).flush();
+#endif
+        buffer.clear();
     }
 
-    std::string SetColor(bool newbold,int newcolor)
+    void SetColor(bool newbold,int newcolor)
     {
         if(((newbold != bold) || newcolor != color) && enabled)
-            return "\33[%d;%dm"_f % (bold=newbold) % (color=newcolor);
-        return {};
+        {
+            char sequence[16];
+            buffer.append(sequence, std::snprintf(sequence, sizeof(sequence), "\33[%d;%dm",
+                                                  int(bold=newbold), color=newcolor));
+        }
     }
     void EnableDisable(bool state)
     {
         enabled = state;
         if(enabled) *this << "`dfl`";
     }
-} static term;
+};
 
 struct ItemReference
 {
@@ -209,15 +337,28 @@ struct ItemReference
         // Ignored for money
         long        index = 1;
     };
-    std::deque<SingleReference> refs, except;
+    std::vector<SingleReference> refs, except;
 
-    ItemReference(const char* what) : ItemReference( std::string(what) ) {}
+    ItemReference(const char* what)        : ItemReference( std::string_view(what) ) {}
+    ItemReference(const std::string& what) : ItemReference( std::string_view(what) ) {}
 
-    ItemReference(const std::string& what)
+    // The request is read in one pass, without copying anything but the
+    // names of the items into the references.
+    ItemReference(std::string_view what)
     {
-        std::smatch res;
-        std::regex_match(what, res, "(.*?)(?: except (.+))?"_r);
-        original = res[1];
+        // A request that spans lines is not understood at all.
+        if(what.find_first_of("\r\n") != what.npos) return;
+
+        // Anything after the first " except " is not wanted after all.
+        std::string_view unwanted;
+        for(auto p = what.find(" except "); p != what.npos; p = what.find(" except ", p+1))
+            if(p + 8 < what.size())
+            {
+                unwanted = what.substr(p + 8);
+                what     = what.substr(0, p);
+                break;
+            }
+        original = what;
 
         // For "all"-type entries, add a dummy entry that indicates "everything"
         if(original == "all" || original == "everything")
@@ -227,13 +368,13 @@ struct ItemReference
             w.index = 0;
             refs.push_back(w);
         }
-        else if(!original.empty())
+        else
         {
             // Deal with a comma-separated list of operands
-            ParseReferences(refs, original);
+            ParseReferences(refs, what);
         }
 
-        if(res[2].length()) ParseReferences(except, res[2]);
+        ParseReferences(except, unwanted);
     }
 
     // True if this request clearly intends to address only one specific item
@@ -242,41 +383,96 @@ struct ItemReference
         return !everything && refs.size() == 1 && refs[0].amount <= 1 && refs[0].index >= 1;
     }
 
-    void ParseReferences(std::deque<SingleReference>& list, const std::string& what)
+    // Split a list such as "two shirts, a cap and all daggers" into
+    // references. They are separated by commas and "and"s, with any
+    // number of spaces around them.
+    static void ParseReferences(std::vector<SingleReference>& list, std::string_view what)
     {
-        std::regex pat(" *((?:(?! *,| and | *$).)+)(?:[ ,]|and )*");
-        std::smatch res;
-        for(auto b = what.begin(); std::regex_search(b, what.end(), res, pat); b = res[0].second)
-            list.push_back( ParseSingleReference( res[1] ) );
+        const std::size_t n = what.size();
+        auto SkipSpaces = [&](std::size_t p) { while(p < n && what[p] == ' ') ++p; return p; };
+        std::size_t p = 0;
+        while(p < n && (what[p] == ' ' || what[p] == ',')) ++p;
+        while(p < n)
+        {
+            // The reference ends at a comma, or at spaces followed by
+            // a comma, " and " or the end.
+            std::size_t end = p + 1;
+            for(;;)
+            {
+                end = std::min(what.find_first_of(" ,", end), n);
+                if(end == n || what[end] == ',') break;
+                std::size_t next = SkipSpaces(end);
+                if(next == n || what[next] == ',') break;
+                if(what.compare(next, 4, "and ") == 0) { end = next - 1; break; }
+                end = next;
+            }
+            list.push_back( ParseSingleReference( what.substr(p, end - p) ) );
+
+            // Skip the separators.
+            for(p = end; p < n; )
+                if(what[p] == ' ' || what[p] == ',')  ++p;
+                else if(what.compare(p, 4, "and ") == 0) p += 4;
+                else break;
+        }
     }
-    SingleReference ParseSingleReference(const std::string& part) const
+    static SingleReference ParseSingleReference(std::string_view part)
     {
         SingleReference w;
-        // Read the item count from the begin of the string.
-        std::string word = part;
-        for(unsigned a=1; a<=12; ++a)
-            word = std::regex_replace(word,
-                std::regex( (R"(^%s\b)"_f % Numerals1to12[a-1]).str() ),
-                ("%u"_f % a).str());
-        static std::regex pattern("^((all|[0-9]+) +)? *(.*)");
-        std::smatch res;
-        std::regex_match(word, res, pattern);
-        w.what                 = res[3]; // Item name without number
-        std::string number_str = res[2]; // The number, if any; empty otherwise
-        if(number_str == "all")
+        auto IsDigit = [](char c) { return c >= '0' && c <= '9'; };
+        // Numbers too large to count anything with are as good as infinite.
+        auto Number = [](std::string_view digits)
+        {
+            long n = 0;
+            if(std::from_chars(digits.data(), digits.data() + digits.size(), n).ec != std::errc()) n = LONG_MAX;
+            return n;
+        };
+
+        // Read the item count from the begin of the string. It is
+        // a number of digits or a numeral, followed by spaces, or "all".
+        unsigned numeral = 0;
+        for(unsigned a=1; a<=12 && !numeral; ++a)
+        {
+            std::string_view word = Numerals1to12[a-1];
+            if(part.compare(0, word.size(), word) == 0
+            && (part.size() == word.size() || !IsWordChar(part[word.size()])))
+            {
+                numeral = a;
+                part.remove_prefix(word.size());
+            }
+        }
+        std::size_t digits = 0;
+        bool counted = true;
+        if(!numeral)
+            while(digits < part.size() && IsDigit(part[digits])) ++digits;
+        if(!numeral && part.compare(0, 4, "all ") == 0)
+        {
             w.index = 0;
-        else if(!number_str.empty())
-            w.amount = std::stol(number_str);
+            part.remove_prefix(3);
+        }
+        else if((numeral || digits) && digits < part.size() && part[digits] == ' ')
+        {
+            w.amount = numeral ? long(numeral) : Number(part.substr(0, digits));
+            part.remove_prefix(digits);
+        }
         else
         {
-            // Read the possible item index from the end of the string.
-            static std::regex pattern("^(.*?)(?: +([0-9]+))?$");
-            std::smatch res;
-            std::regex_match(w.what, res, pattern);
-            w.what             = res[1]; // Item name without number
-            number_str         = res[2]; // The number, if any; empty otherwise
-            if(!number_str.empty())
-                w.index = std::stol(number_str);
+            // A numeral that is not followed by a space is just a number.
+            if(numeral) w.what = std::to_string(numeral);
+            counted = false;
+        }
+        part.remove_prefix(std::min(part.find_first_not_of(' '), part.size()));
+        w.what += part;
+        if(counted) return w;
+
+        // Read the possible item index from the end of the string.
+        std::size_t index = w.what.size();
+        while(index > 0 && IsDigit(w.what[index-1])) --index;
+        std::size_t name_end = index;
+        while(name_end > 0 && w.what[name_end-1] == ' ') --name_end;
+        if(index < w.what.size() && name_end < index)
+        {
+            w.index = Number(std::string_view(w.what).substr(index));
+            w.what.erase(name_end);
         }
         return w;
     }
@@ -346,34 +542,66 @@ FoodTypes[] =
 
 // Determine how well the player character
 // could eat by selling all their treasures.
-static std::string Appraise(double value, int v=1, std::size_t maxi=3)
+static std::string Appraise(double value, std::size_t maxi=3)
 {
-    std::deque<std::string> list; redo:
-    for(const auto& f: FoodTypes)
-        if(value >= f.worth)
+    // The names of the foods, decrypted once.
+    static const auto names = []
+    {
+        std::vector<std::string> names;
+        for(const auto& f: FoodTypes)
         {
-            std::string k = f.name;
-            for(auto& c: k) if(c-' ') c=1+((c-1)^v);
-            list.push_back(k); value -= f.worth;
-            if(list.size() < maxi) goto redo;
-            break;
+            auto& k = names.emplace_back(f.name);
+            for(auto& c: k) if(c-' ') c=1+((c-1)^1);
         }
-    if(list.empty()) return "nothing at all";
-    return ListWithCounts( std::move(list) );
+        return names;
+    }();
+    // Every worth is a whole number, so only the whole part of the value
+    // matters. And no more can be bought than "maxi" of the dearest food
+    // (but at least one food is, if any).
+    if(!(value >= FoodTypes[count(FoodTypes)-1].worth)) return "nothing at all";
+    maxi = std::max<std::size_t>(maxi, 1);
+    auto whole = std::uint64_t(std::min(value, double(FoodTypes[0].worth) * maxi));
+
+    // Remember the answers that have been given by this thread.
+    static thread_local std::unordered_map<std::uint64_t, std::string> memo;
+    assert(maxi < 64);
+    const std::uint64_t key = whole * 64 + maxi;
+    auto i = memo.find(key);
+    if(i != memo.end()) return i->second;
+    if(memo.size() >= 4096) memo.clear();
+
+    // Buy as many of the dearest food as possible, then of the next one.
+    ScratchList list(&scratch.resource);
+    std::uint64_t left = whole;
+    for(std::size_t f=0; f<count(FoodTypes) && list.size() < maxi; ++f)
+    {
+        auto worth = std::uint64_t(FoodTypes[f].worth);
+        auto n = std::min<std::uint64_t>(left / worth, maxi - list.size());
+        left -= n * worth;
+        while(n-- > 0) list.emplace_back(names[f]);
+    }
+    return memo[key] = ListWithCounts( std::move(list) );
 }
 
 struct ItemType
 {
-    // Any item has these three attributes.
-    std::size_t type      = frand() > 0.4 ? rand(count(ItemTypes))  : rand(4);
-    std::size_t build     = frand() > 0.4 ? rand(count(BuildTypes)) : rand(2);
-    std::size_t condition = frand() > 0.8 ? rand(count(CondTypes))  : rand(3);
+    // Any item has these three attributes (indexes to the tables above).
+    std::uint8_t type, build, condition;
 
     // If this is a chest, the above three values are ignored and this is nonzero.
     float       chest = 0.f;
     // If this is a cart, this is non-null and the others are irrelevant.
     std::shared_ptr<struct Eq> cart;
 
+    // Create a random item, or an item of the given attributes.
+    template<typename Random>
+    explicit ItemType(Random& rnd)
+        : type     ( frand() > 0.4 ? rand(count(ItemTypes))  : rand(4) ),
+          build    ( frand() > 0.4 ? rand(count(BuildTypes)) : rand(2) ),
+          condition( frand() > 0.8 ? rand(count(CondTypes))  : rand(3) ) {}
+    ItemType(std::size_t type, std::size_t build, std::size_t condition)
+        : type(type), build(build), condition(condition) {}
+
     std::string GetType() const;
     std::string GetMaterial() const;
     std::string GetCondition() const;
@@ -384,58 +612,216 @@ struct ItemType
     //       cond=1:   changes "shirt" into "awesome shirt"
     std::string name(int cond=0, int mat=0) const;
     std::string look(bool specific) const;
+    // All the names that the item can be referred to with in commands,
+    // from the most specific to the least specific. See Eq::find_item().
+    std::vector<std::string> names() const;
+
+    // Items of the same kind are always called by the same names.
+    // Regular items are grouped by their three attributes, and chests
+    // by their condition. Carts are named after their contents, so
+    // they do not fit in any fixed number of kinds.
+    enum : unsigned { NumItemKinds = count(ItemTypes) * count(BuildTypes) * count(CondTypes),
+                      NumKinds     = NumItemKinds + 3 };
+    unsigned kind() const
+    {
+        if(chest > 0.f) return NumItemKinds + (chest < 0.35f ? 0 : chest < 0.75f ? 1 : 2);
+        return (type * count(BuildTypes) + build) * count(CondTypes) + condition;
+    }
 
     // Calculate the weight and monetary value of an item.
-    float weight() const
+    float weight() const;
+    // The worth is proportional to a constant, 300 unless another is given.
+    float value() const;
+    float value(float constant) const;
+    bool immovable() const
     {
-        if(chest > 0.f || cart) return 999.f;
-        return BuildTypes[build].weight
-             * ItemTypes[type].weight;
+        return chest > 0.f || cart;
     }
-    float value(float constant=300.f) const
+};
+
+// The weight and the value of every kind of item, computed once,
+// so that summing them over many items is just a table lookup each.
+struct KindTable
+{
+    float weight[ItemType::NumKinds], value[ItemType::NumKinds];
+
+    KindTable()
     {
-        if(chest > 0.f || cart) return 0.f;
-        return constant * BuildTypes[build].worth
-                        * ItemTypes[type].worth
-                        * CondTypes[condition].worth;
+        for(unsigned k = 0; k < ItemType::NumItemKinds; ++k)
+        {
+            const auto& t = ItemTypes [k / count(CondTypes) / count(BuildTypes)];
+            const auto& b = BuildTypes[k / count(CondTypes) % count(BuildTypes)];
+            const auto& c = CondTypes [k % count(CondTypes)];
+            weight[k] = b.weight * t.weight;
+            value[k]  = 300.f * b.worth * t.worth * c.worth;
+        }
+        // Chests are heavy and worthless.
+        for(unsigned k = ItemType::NumItemKinds; k < ItemType::NumKinds; ++k)
+        {
+            weight[k] = 999.f;
+            value[k]  = 0.f;
+        }
     }
-    bool immovable() const
+} static const kind_table;
+
+float ItemType::weight() const
+{
+    if(cart) return 999.f;
+    return kind_table.weight[kind()];
+}
+float ItemType::value() const
+{
+    if(cart) return 0.f;
+    // The table has the values for the default constant.
+    return kind_table.value[kind()];
+}
+float ItemType::value(float constant) const
+{
+    if(cart || chest > 0.f) return 0.f;
+    return constant * BuildTypes[build].worth
+                    * ItemTypes[type].worth
+                    * CondTypes[condition].worth;
+}
+
+// An index from every name that an item can be called with
+// to the kinds of items (ItemType::kind()) that have that name.
+struct NameIndex
+{
+    std::unordered_map<std::string, std::vector<std::uint16_t>> kinds;
+
+    NameIndex()
     {
-        return chest > 0.f || cart;
+        for(unsigned k = 0; k < ItemType::NumKinds; ++k)
+        {
+            ItemType item(k / count(CondTypes) / count(BuildTypes),
+                          k / count(CondTypes) % count(BuildTypes),
+                          k % count(CondTypes));
+            if(k >= ItemType::NumItemKinds)
+                item.chest = (k - ItemType::NumItemKinds) * 0.4f + 0.2f;
+            for(const auto& n: item.names())
+            {
+                auto& list = kinds[n];
+                if(list.empty() || list.back() != k) list.push_back(k);
+            }
+        }
+    }
+
+    // Returns the sorted list of kinds that have this name, or nullptr.
+    const std::vector<std::uint16_t>* find(const std::string& name) const
+    {
+        auto i = kinds.find(name);
+        return i == kinds.end() ? nullptr : &i->second;
+    }
+} static const name_index;
+
+// Index of the names that money goes by, to the types of coins that
+// each name means (as a bitmask of MoneyTypes).
+struct MoneyIndex
+{
+    std::unordered_map<std::string, unsigned> types;
+
+    MoneyIndex()
+    {
+        static_assert(count(MoneyTypes) <= 32, "Too many types of coins");
+        for(const char* any: { "", "money", "coin", "coins" })
+            types[any] = (1u << count(MoneyTypes)) - 1;
+        for(unsigned m = 0; m < count(MoneyTypes); ++m)
+            for(const char* suffix: { "", " coin", " coins" })
+                types[MoneyTypes[m].name + std::string(suffix)] |= 1u << m;
+    }
+
+    // Returns the types of coins that go by this name, if any.
+    unsigned find(const std::string& name) const
+    {
+        auto i = types.find(name);
+        return i == types.end() ? 0 : i->second;
+    }
+} static const money_index;
+
+// A list of items. New items go in front of the others, so the list is
+// kept in a vector in reverse order, where that is done in constant
+// time. Positions and iteration are from the front, as usual.
+struct ItemList
+{
+    std::vector<ItemType> last_first;
+
+    typedef std::vector<ItemType>::reverse_iterator       iterator;
+    typedef std::vector<ItemType>::const_reverse_iterator const_iterator;
+    iterator       begin()       { return last_first.rbegin(); }
+    iterator       end()         { return last_first.rend(); }
+    const_iterator begin() const { return last_first.rbegin(); }
+    const_iterator end()   const { return last_first.rend(); }
+
+    std::size_t size()  const { return last_first.size(); }
+    bool        empty() const { return last_first.empty(); }
+    ItemType&       operator[](std::size_t n)       { return last_first[last_first.size()-1 - n]; }
+    const ItemType& operator[](std::size_t n) const { return last_first[last_first.size()-1 - n]; }
+
+    void push_front(const ItemType& item) { last_first.push_back(item); }
+    // Put these items in front of the others, in the same order.
+    template<typename It>
+    void insert_front(It first, It last)
+    {
+        last_first.insert(last_first.end(), std::make_reverse_iterator(last), std::make_reverse_iterator(first));
+    }
+    // Remove the n'th item. The items in front of it are moved.
+    void erase(std::size_t n) { last_first.erase(last_first.end()-1 - n); }
+    // Remove the first n items.
+    void erase_front(std::size_t n) { last_first.erase(last_first.end() - n, last_first.end()); }
+    // Replace the items with these, in this order.
+    void assign(std::vector<ItemType>&& items)
+    {
+        last_first = std::move(items);
+        std::reverse(last_first.begin(), last_first.end());
     }
+    void clear() { last_first.clear(); }
 };
 
 // Collection of items and money, either in character's pocket,
 // on the ground, or in a container.
 struct Eq
 {
-    std::deque<ItemType> Items;
+    // The items may be read directly, but they must only be changed
+    // through the functions below, which keep the totals up to date.
+    ItemList Items;
     long Money[ count(MoneyTypes) ] = { 0 };
 
+    // Running totals of the worth and weight of all Items.
+    double items_value = 0., items_weight = 0.;
+
     // Calculate the total worth of all these items and coins.
+    // (For printing, see printed_value().)
     float value() const
     {
-        // Count all the money
-        float result = 0.f; size_t a=0;
-        for(auto m: Money)        result += m * MoneyTypes[a++].worth;
-        // Add the worth of all items.
-        for(const auto& i: Items) result += i.value();
+        assert(totals_ok());
+        // Count all the money, and add the worth of all items.
+        double result = items_value; size_t a=0;
+        for(auto m: Money) result += m * MoneyTypes[a++].worth;
         return result;
     }
     // Calculate the total weight of all these items and coins.
     float weight() const
     {
-        // Count all the money
-        float result = 0.f; size_t a=0;
-        for(auto m: Money)        result += m * MoneyTypes[a++].weight;
-        // Add the weight of all items.
-        for(const auto& i: Items) result += i.weight();
+        assert(totals_ok());
+        // Count all the money, and add the weight of all items.
+        double result = items_weight; size_t a=0;
+        for(auto m: Money) result += m * MoneyTypes[a++].weight;
         return result;
     }
     long burden() const
     {
         return 1 + weight();
     }
+    // The total worth, summed in single precision with the coins first
+    // and then the items in order, as it has always been printed. The
+    // running total of value() can differ from it in the last cent.
+    float printed_value() const
+    {
+        float result = 0.f; size_t a=0;
+        for(auto m: Money)        result += m * MoneyTypes[a++].worth;
+        for(const auto& i: Items) result += i.value();
+        return result;
+    }
     std::size_t count_items() const
     {
         std::size_t result = Items.size();
@@ -444,10 +830,62 @@ struct Eq
     }
 
     // Clear the list of items (or generate N random items).
-    void clear(std::size_t n = 0)
+    void clear()
     {
-        Items.resize(n);
+        Items.clear();
         for(auto& m: Money) m = 0;
+        items_value = items_weight = 0.;
+    }
+    template<typename Random>
+    void clear(std::size_t n, Random& rnd)
+    {
+        std::vector<ItemType> items;
+        items.reserve(n);
+        while(items.size() < n) items.emplace_back(rnd);
+        assign(std::move(items));
+    }
+    // Replace the items with these, in this order.
+    void assign(std::vector<ItemType>&& items)
+    {
+        Items.assign(std::move(items));
+        items_value = items_weight = 0.;
+        for(const auto& i: Items) account(i, 1);
+    }
+
+    // Add an item in front of all others.
+    void push_front(const ItemType& item)
+    {
+        Items.push_front(item);
+        account(item, 1);
+    }
+    // Remove the n'th item.
+    void erase(std::size_t n)
+    {
+        account(Items[n], -1);
+        Items.erase(n);
+    }
+    // Change the n'th item in place with the given function.
+    template<typename F>
+    void modify(std::size_t n, F&& change)
+    {
+        account(Items[n], -1);
+        change(Items[n]);
+        account(Items[n], 1);
+    }
+
+    // Add (sign=1) or remove (sign=-1) the item from the totals.
+    void account(const ItemType& item, int sign)
+    {
+        items_value  += sign * item.value();
+        items_weight += sign * item.weight();
+    }
+    // Verify the totals by counting everything again.
+    bool totals_ok() const
+    {
+        double value = 0., weight = 0.;
+        for(const auto& i: Items) { value += i.value(); weight += i.weight(); }
+        return std::abs(value  - items_value)  <= 1e-6 * (1. + std::abs(value))
+            && std::abs(weight - items_weight) <= 1e-6 * (1. + std::abs(weight));
     }
 
     // Generate the output for "looking at" an item.
@@ -479,11 +917,12 @@ struct Eq
         float itemsvalue = 0.f, moneyvalue = 0.f;
         std::string result;
 
-        // List all items and count their total value.
-        std::deque<std::string> names;
+        // List all items and count their total value (in the same order
+        // as always, so that the last cent does not change).
+        ScratchList names(&scratch.resource);
         for(const auto& i: Items)
         {
-            names.push_back( AddArticle(i.name(0, 1)) );
+            AppendWithArticle(names.emplace_back(), i.name(0, 1));
             itemsvalue += i.value();
         }
 
@@ -526,11 +965,9 @@ struct Eq
     {
         // For each type of coins that does exist, accept it,
         // if it matches the user's request.
+        unsigned types = money_index.find(w.what);
         for(std::size_t m = first; m < count(MoneyTypes); ++m)
-            if(Money[m] > 0
-            && std::regex_match(w.what,
-                std::regex( ("|money|coins?|%s( coins?)?"_f % MoneyTypes[m].name).str() )
-                               )) return m;
+            if(Money[m] > 0 && (types >> m & 1)) return m;
         return -1;
     }
     // Finds items matching the given keywords. -1 = no item found.
@@ -549,28 +986,80 @@ struct Eq
     // Ignores "amount" in the SingleReference
     long find_item(const ItemReference::SingleReference& w, std::size_t first=0) const
     {
-        // From more specific to less specific,
-        // check if we found what the player asked for.
+        // Look up which kinds of items go by this name, and then
+        // check each item against that list.
+        const auto* kinds = name_index.find(w.what);
         long occurrences = 0;
-        for(std::size_t a = 0; a < Items.size(); ++a)
-            for(int level=3*2*4-1; level>=0; --level)
+        // Items before "first" only matter when counting occurrences.
+        bool counting = w.index && !w.amount;
+        for(std::size_t a = counting ? 0 : first; a < Items.size(); ++a)
+        {
+            const auto& item = Items[a];
+            if(!w.what.empty())
             {
-                std::string n = Items[a].name((level/3)%2, level%3);
-                if(level/6 == 1) n = AddArticle(n, false);
-                if(level/6 == 2) n = AddArticle(n, true);
-                if(level/6 == 3) n = Pluralize(n);
-                if(w.what.empty() || w.what == n)
+                if(item.cart)
                 {
-                    // break = continue item loop
-                    if(w.index && !w.amount && ++occurrences != w.index) break;
-                    if(a < first) break;
-                    return a;
+                    // Carts are rare, so just check all their names.
+                    auto n = item.names();
+                    if(std::find(n.begin(), n.end(), w.what) == n.end()) continue;
                 }
+                else if(!kinds || !std::binary_search(kinds->begin(), kinds->end(), item.kind()))
+                    continue;
             }
+            if(counting && ++occurrences != w.index) continue;
+            if(a < first) continue;
+            return a;
+        }
         // Give up if nothing matched
         return -1;
     }
 
+    // Move the items at the given positions (in ascending order) into the
+    // front of the target, in the same order as if each of them was moved
+    // with push_front() in turn. Only the items up to the last one moved
+    // are walked through.
+    void move_items(Eq& target, const std::vector<std::size_t>& which)
+    {
+        std::vector<ItemType> moved;
+        moved.reserve(which.size());
+        for(auto i = which.rbegin(); i != which.rend(); ++i)
+        {
+            account(Items[*i], -1);
+            target.account(Items[*i], 1);
+            moved.push_back(std::move(Items[*i]));
+        }
+        // Close the gaps left by the moved items, by moving back the
+        // items in front of them.
+        std::size_t out = which.back(), next = which.size();
+        for(std::size_t in = which.back() + 1; in-- > 0; )
+            if(next > 0 && which[next-1] == in)
+                --next;
+            else
+                Items[out--] = std::move(Items[in]);
+        Items.erase_front(which.size());
+        target.Items.insert_front(std::make_move_iterator(moved.begin()),
+                                  std::make_move_iterator(moved.end()));
+    }
+    // Undo move_items(): put the items back to their original positions.
+    void unmove_items(Eq& target, const std::vector<std::size_t>& which)
+    {
+        std::size_t n = which.size();
+        std::vector<ItemType> merged;
+        merged.reserve(Items.size() + n);
+        auto rest = Items.begin();
+        for(std::size_t k = 0; k < n; ++k)
+        {
+            while(merged.size() < which[k]) merged.push_back(std::move(*rest++));
+            auto& item = target.Items[n-1-k];
+            target.account(item, -1);
+            account(item, 1);
+            merged.push_back(std::move(item));
+        }
+        std::move(rest, Items.end(), std::back_inserter(merged));
+        Items.assign(std::move(merged));
+        target.Items.erase_front(n);
+    }
+
     // Move items.
     //      target    = Where to move them to.
     //      what      = What to move
@@ -579,15 +1068,30 @@ struct Eq
     // If any of the individual moves fails, no move is performed.
     struct moveresult
     {
-        std::deque<std::string> moved;
-        std::deque<std::string> notfound;
-        std::deque<std::string> immovable;
+        ScratchList moved     { &scratch.resource };
+        ScratchList notfound  { &scratch.resource };
+        ScratchList immovable { &scratch.resource };
+    };
+    // A record of items or coins moved from one Eq to another,
+    // so that the move can be undone.
+    struct Change
+    {
+        Eq*                      from;
+        Eq*                      to;
+        std::vector<std::size_t> items;         // Original positions of moved items, or
+        long                     money_id = 0,  // the type of coins moved,
+                                 money    = 0;  // and their number.
     };
     moveresult move(Eq& target, const ItemReference& what)
+    {
+        std::vector<Change> journal;
+        return move(target, what, journal);
+    }
+    moveresult move(Eq& target, const ItemReference& what, std::vector<Change>& journal)
     {
         moveresult result;
-        // Make backup of both parties of the move.
-        Eq target_backup = target, me_backup = *this;
+        // Remember where we started, so that we can undo this move.
+        const std::size_t start = journal.size();
 
         // Deal with the entire list of sub-requests
         for(const auto& w: what.refs)
@@ -595,43 +1099,38 @@ struct Eq
             bool found_item=false, found_money=false, all = !w.index;
 
             // Try finding items matching the description.
-            // Do in two passes. First check if the request is satisfiable,
-            // and then enact it.
-            for(int round=1; round<=2; ++round)
+            // First make a list of what to move, to check if the request
+            // is satisfiable, and then move everything at once.
+            std::vector<std::size_t> plan;
+            long remaining_items = w.amount ? w.amount : 1;
+            for(long item_id=0; (item_id = find_item(w, item_id)) >= 0; ++item_id)
             {
-                long remaining_items = w.amount ? w.amount : 1;
-                for(long item_id=0; (item_id = find_item(w, item_id)) >= 0; )
-                {
-                    if(round == 2)
-                    {
-                        std::string name = AddArticle(Items[item_id].name(0,1));
-                        if(Items[item_id].immovable())
-                        {
-                            result.immovable.push_back( name );
-                            ++item_id;
-                        }
-                        else
-                        {
-                            // Append the name of moved item to the move list
-                            result.moved.push_back( name );
-                            // Move the item from our list to the target list
-                            target.Items.push_front( Items[item_id] );
-                            Items.erase( Items.begin() + item_id );
-                        }
-                    }
-                    else
-                        ++item_id;
+                plan.push_back(item_id);
+                found_item = true;
+                if(!all && --remaining_items <= 0) break;
+            }
+            // Get nothing, if the user explicitly specified e.g.
+            // "get 3 shirts" but there was only 2 on the ground.
+            if(found_item && !all && remaining_items > 0)
+            {
+                found_item = false;
+                plan.clear();
+            }
 
-                    found_item = true;
-                    if(!all && --remaining_items <= 0) break;
-                }
-                // Get nothing, if the user explicitly specified e.g.
-                // "get 3 shirts" but there was only 2 on the ground.
-                if(round == 1 && found_item && !all && remaining_items > 0)
-                {
-                    found_item = false;
-                    break;
-                }
+            Change change { this, &target, {} };
+            for(auto item_id: plan)
+            {
+                // Append the name of the item to the move list (or to the immovables)
+                bool immovable = Items[item_id].immovable();
+                AppendWithArticle((immovable ? result.immovable : result.moved).emplace_back(),
+                                  Items[item_id].name(0,1));
+                if(!immovable) change.items.push_back( item_id );
+            }
+            if(!change.items.empty())
+            {
+                // Move the items from our list to the target list
+                move_items(target, change.items);
+                journal.push_back( std::move(change) );
             }
 
             // Then do the same for money in the same manner.
@@ -649,13 +1148,14 @@ struct Eq
                     if(round == 2)
                     {
                         // Append the name of moved item to the move list
-                        result.moved.push_back( "%ld %s %s"_f
-                                                % get_money
-                                                % MoneyTypes[money_id].name
-                                                % (get_money==1 ? "coin" : "coins") );
+                        result.moved.emplace_back( std::string("%ld %s %s"_f
+                                                   % get_money
+                                                   % MoneyTypes[money_id].name
+                                                   % (get_money==1 ? "coin" : "coins")) );
                         // Move the item from our list to the target list
                         target.Money[money_id] += get_money;
                         Money[money_id] -= get_money;
+                        journal.push_back( {this, &target, {}, money_id, get_money} );
                     }
                     else
                         ++money_id;
@@ -674,7 +1174,7 @@ struct Eq
             }
 
             if(!found_item && !found_money && !what.everything)
-                result.notfound.push_back(w.what);
+                result.notfound.emplace_back(w.what);
         }
 
         if(!what.except.empty())
@@ -682,32 +1182,42 @@ struct Eq
             // Move all the "except" stuff back
             ItemReference takeback("");
             takeback.refs = what.except;
-            auto r = target.move(*this, takeback);
+            auto r = target.move(*this, takeback, journal);
             // Merge the "notfound"s
             for(const auto& s: r.notfound) result.notfound.push_back(s);
             // Remove those immovables & moveds that were in "except"
-            std::set<std::string> m(r.moved.begin(), r.moved.end());
+            std::pmr::set<std::string_view> m(r.moved.begin(), r.moved.end(), &scratch.resource);
             result.moved.erase(
                 std::remove_if(result.moved.begin(), result.moved.end(),
-                    [&m](const std::string& s) { return m.find(s) != m.end(); }),
+                    [&m](const ScratchString& s) { return m.find(s) != m.end(); }),
                 result.moved.end());
-            std::set<std::string> i(r.immovable.begin(), r.immovable.end());
+            std::pmr::set<std::string_view> i(r.immovable.begin(), r.immovable.end(), &scratch.resource);
             result.immovable.erase(
                 std::remove_if(result.immovable.begin(), result.immovable.end(),
-                    [&i](const std::string& s) { return i.find(s) != i.end(); }),
+                    [&i](const ScratchString& s) { return i.find(s) != i.end(); }),
                 result.immovable.end());
         }
 
         if(!result.notfound.empty()) result.moved.clear();
         if(result.moved.empty())
         {
-            // Restore backup.
-            target = target_backup;
-            *this = me_backup;
+            // Undo everything done since the start, latest first.
+            while(journal.size() > start)
+            {
+                auto& c = journal.back();
+                if(!c.items.empty())
+                    c.from->unmove_items(*c.to, c.items);
+                else
+                {
+                    c.from->Money[c.money_id] += c.money;
+                    c.to->Money[c.money_id]   -= c.money;
+                }
+                journal.pop_back();
+            }
         }
         return result;
     }
-} static eq;
+};
 
 std::string ItemType::GetType() const
 {
@@ -756,6 +1266,21 @@ std::string ItemType::name(int cond, int mat) const
     return result;
 }
 
+std::vector<std::string> ItemType::names() const
+{
+    std::vector<std::string> result;
+    for(int level=3*2*4-1; level>=0; --level)
+    {
+        std::string n, base = name((level/3)%2, level%3);
+        if(level/6 == 0) n = base;
+        if(level/6 == 1) AppendWithArticle(n, base, false);
+        if(level/6 == 2) AppendWithArticle(n, base, true);
+        if(level/6 == 3) AppendPlural(n, base);
+        result.push_back(n);
+    }
+    return result;
+}
+
 std::string ItemType::look(bool specific) const
 {
     std::string info, common = specific
@@ -774,7 +1299,7 @@ std::string ItemType::look(bool specific) const
 
     if(!cart && chest <= 0.f && specific)
         info = "You estimate that with it you could probably purchase %s.\n"_f
-               % Appraise(value(), 1, 1);
+               % Appraise(value(), 1);
 
     return common + info;
 }
@@ -784,658 +1309,1117 @@ std::string ItemType::look(bool specific) const
 // Any particular room in the puzzle may contain the following:
 struct Room
 {
-    std::size_t Wall=0, Env=0;  // Indexes
-    unsigned seed = 0;          // For maze generation
+    std::uint8_t Wall=0, Env=0; // Indexes
+    std::uint8_t seed = 0;      // For maze generation
     Eq items;                   // What is lying on the floor
 
 // Create a model "default" room based on empty definitions.
 } static const defaultroom;
 
-
-struct Maze
+// The maze is stored in square chunks of rooms. Within a chunk, the
+// attributes of every room are kept in dense arrays. Complete Room
+// records (with copies of those attributes) exist only for the rooms
+// that have something in them, or that have been accessed as a Room.
+struct Chunk
 {
-    // A maze contains rooms.
-    std::map<long/*x*/,std::map<long/*y*/,Room> > rooms;
-
-    // Generate a room at given coordinates.
-    // The "model" room will help the maze generator generate
-    // similar rooms in nearby locations.
-    Room& GenerateRoom(long x,long y, const Room& model, unsigned seed)
+    enum : unsigned { Bits = 4, Size = 1u << Bits, Cells = Size*Size };
+
+    // Which rooms exist, and which are in "rooms" too. A room's bit is
+    // set only once it is complete, so that it can be read without locking.
+    std::atomic<std::uint64_t> generated[Cells/64] {}, stored[Cells/64] {};
+    std::uint8_t Wall[Cells] = {}, Env[Cells] = {}, seed[Cells] = {};
+    std::unordered_map<unsigned, Room> rooms;
+    // In a shared maze, guards "rooms" and everything in them.
+    mutable std::recursive_mutex lock;
+    // When the chunk was last used, whether it has changed since it was
+    // last put away, and whether the contents of any room have changed
+    // since they were generated. See Maze::Trim().
+    unsigned long used = 0;
+    bool dirty = false, modified = false;
+    // How every room looks on the map (see Char()), kept up to date
+    // while "mapped" is set. In a shared maze, guarded by "lock".
+    char map[Cells];
+    bool mapped = false;
+
+    bool Generated(unsigned c) const { return generated[c/64].load(std::memory_order_acquire) >> (c%64) & 1; }
+    bool Stored(unsigned c)    const { return stored[c/64].load(std::memory_order_acquire) >> (c%64) & 1; }
+    void SetGenerated(unsigned c) { generated[c/64].fetch_or(std::uint64_t(1) << (c%64), std::memory_order_release); }
+    void SetStored(unsigned c)    { stored[c/64].fetch_or(std::uint64_t(1) << (c%64), std::memory_order_release); }
+
+    // Describe a room with a single character. In a shared maze, the
+    // caller must hold the lock.
+    char Char(unsigned c) const
     {
-        rnd.seed( y*0xc70f6907UL + x*2166136261UL );
-        auto insres = rooms[x].insert( {y, model} );
-        Room& room = insres.first->second;
-        if(insres.second)
-        {
-            room.items.clear();
-            float chestrand = frand();
-            // If a new room was indeed inserted, make changes in it.
-            room.seed  = (seed + (frand() > 0.95 ? rand(4) : 0)) & 3;
-            // 10% chance for the environment type to change.
-            if(frand() > 0.9) room.Env = rand(count(EnvTypes));
-            if(frand() > (seed==model.seed ? 0.95 : 0.1))
-                room.Wall = frand() < 0.4 ? 2 : 0;
-            // Generate a few items in the room.
-            room.items.clear(unsigned(std::pow(frand(), 40.0) * 8.5));
-            // Sometimes make a chest too.
-            if(chestrand < 0.1f) { ItemType i; i.chest = 1.f; room.items.Items.push_front(i); }
-            // Sometimes make a cart.
-            if(frand() < 0.005f) { ItemType i; i.cart.reset(new Eq); room.items.Items.push_front(i); }
-        }
-        return room;
-    }
-    // Describe the room with a single character.
-    char Char(long x,long y) const
-    {
-        auto i = rooms.find(x);     if(i == rooms.end())     return ' ';
-        auto j = i->second.find(y); if(j == i->second.end()) return ' ';
-        if(j->second.Wall)          return '#';
-        if(!j->second.items.Items.empty())
-        {
-            // If there is a chest or a cart, display it differently.
-            for(const auto& i: j->second.items.Items) if(i.chest > 0.f) return 'c';
-            for(const auto& i: j->second.items.Items) if(i.cart)        return 'r';
-            return 'i';
-        }
+        if(!Generated(c)) return ' ';
+        if(Wall[c])       return '#';
+        if(!Stored(c))    return '.';
+        const auto& items = rooms.find(c)->second.items.Items;
+        // If there is a chest or a cart, display it differently.
+        for(const auto& i: items) if(i.chest > 0.f) return 'c';
+        for(const auto& i: items) if(i.cart)        return 'r';
+        if(!items.empty())    return 'i';
         return '.';
     }
-} static maze;
-
-
-// Player's location and life.
-static long x=0, y=0, life=1000;
-static bool pulling=false;
+    // Bring the map of the chunk up to date.
+    const char* Map()
+    {
+        if(!mapped) for(unsigned c=0; c<Cells; ++c) map[c] = Char(c);
+        mapped = true;
+        return map;
+    }
 
+    // The position of a room within its chunk.
+    static unsigned Cell(long x,long y)
+    {
+        return (y & (Size-1)) * Size + (x & (Size-1));
+    }
+    // The chunk coordinates of a room, as a single key.
+    static std::uint64_t Key(long x,long y)
+    {
+        return std::uint64_t(std::uint32_t(x >> Bits)) << 32 | std::uint32_t(y >> Bits);
+    }
+};
 
-static bool CanMoveTo(long wherex,long wherey, const Room& model = defaultroom)
+// A counter-based random number generator for the maze generator.
+// The n'th number drawn for a room is a pure function of the room's
+// coordinates, the stream number and n (a SplitMix64 hash of them),
+// so rooms can be made in any order and nothing is shared with the
+// gameplay stream.
+struct RoomRandom
 {
-    if(!maze.GenerateRoom(wherex, wherey, model, 0).Wall) return true;
-    return false;
-}
+    typedef std::uint32_t result_type;
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return ~result_type(); }
 
-static Room& SpawnRooms(long wherex,long wherey, const Room& model = defaultroom)
-{
-    Room& room = maze.GenerateRoom(wherex,wherey, model, 0);
-    #define Spawn4rooms(x,y) \
-        for(char p: { 1,3,5,7 }) \
-            maze.GenerateRoom(x + p%3-1, y + p/3-1, room, (p+1)/2)
-    Spawn4rooms(wherex,wherey);
-    for(int o=1; o<5 && CanMoveTo(wherex,wherey+o, room); ++o) Spawn4rooms(wherex,wherey+o);
-    for(int o=1; o<5 && CanMoveTo(wherex,wherey-o, room); ++o) Spawn4rooms(wherex,wherey-o);
-    for(int o=1; o<6 && CanMoveTo(wherex-o,wherey, room); ++o) Spawn4rooms(wherex-o,wherey);
-    for(int o=1; o<6 && CanMoveTo(wherex+o,wherey, room); ++o) Spawn4rooms(wherex+o,wherey);
-    return room;
-}
+    std::uint64_t key, counter = 0;
 
-// This routine is responsible for providing the view for the player.
-// It also generates new maze data.
-static void Look()
-{
-    // Generate rooms in the field of vision of the player.
-    const Room& room = SpawnRooms(x,y);
+    RoomRandom(long x,long y, unsigned stream = 0)
+        : key(Mix(Mix(std::uint64_t(x)) ^ std::uint64_t(y)) ^ Mix(stream)) {}
 
-    // Generate the current map view
-    std::vector<std::string> mapgraph;
-    for(long yo=-4; yo<=4; ++yo)
-    {
-        std::string line;
-        static const std::map<char,const char*> translation =
-        {
-            {'@',"`me`"},
-            {'#',"`wall`"},
-            {'c',"`chest`"},
-            {'r',"`cart`"},
-            {'.',"`road`"},
-            {'i',"`items`"}
-        };
-        for(long xo=-5; xo<=5; ++xo)
-        {
-            char c = ((xo==0&&yo==0) ? '@' : maze.Char(x+xo, y+yo));
-            auto i = translation.find(c);
-            if(i != translation.end()) line += i->second;
-            line += c;
-        }
-        mapgraph.push_back( "`dfl`%s`reset`"_f % line );
+    result_type operator()()
+    {
+        return Mix(key + ++counter * 0x9E3779B97F4A7C15ull) >> 32;
     }
-
-    // This is the text that will be printed on the right side of the map
-    const std::string info_str =
-        "`reset`In a %s tunnel at %+3ld,%+3ld\n"_f % EnvTypes[room.Env].name % x % -y
-      + "`reset`Exits:`exit`%s%s%s%s\n\n"_f
-        % (CanMoveTo(x+0, y-1) ? " north" : "")
-        % (CanMoveTo(x+0, y+1) ? " south" : "")
-        % (CanMoveTo(x-1, y+0) ? " west" : "")
-        % (CanMoveTo(x+1, y+0) ? " east" : "")
-      + room.items.print(false).first;
-
-    // Print the map and the information side by side.
-    auto m = mapgraph.begin();
-    auto b = info_str.begin(), e = info_str.end();
-    auto pat = "([^\n]*)\n"_r;
-    for(std::smatch res; m != mapgraph.end() || b != e; res = std::smatch{})
+    static std::uint64_t Mix(std::uint64_t z)
     {
-        if(b != e) { std::regex_search(b, e, res, pat); b = res[0].second; }
-        std::string sa = m!=mapgraph.end() ? *m++ : std::string(11,' ');
-        std::string sb = res[1];
-        term << "`dfl`%s | `items`%s\n"_f % sa % sb;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
     }
-}
-
-static void EatLife(long l)
-{
-    const char* msg = nullptr;
-    if(life>=800 && life-l<800) msg = "You are so hungry!\n";
-    if(life>=150 && life-l<150) msg = "You are famished!\n";
-    if(life>=70 && life-l<70) msg = "You are about to collapse any second!\n";
-    life -= l;
-    if(msg) { term << "`alert`%s`reset`"_f % msg; }
-}
+};
 
-static bool TryMoveBy(int xd,int yd)
+// The chunks of a maze, in a hash table that many threads can search
+// and add to at once without locking. Each bucket is a list that only
+// grows at its head. Chunks are removed only from tables that just one
+// thread uses.
+struct ChunkTable
 {
-    // If we are moving diagonally, ensure that there is an actual path.
-    if(!CanMoveTo(x+xd, y+yd) || (!CanMoveTo(x,y+yd) && !CanMoveTo(x+xd,y)))
-        { term << "You cannot go that way.\n"; return false; }
-
-    long burden = eq.burden();
-
-    if(pulling)
+    struct Node
     {
-        auto& room   = maze.GenerateRoom(x,y, defaultroom, 0);
-        auto& target = maze.GenerateRoom(x+xd, y+yd, defaultroom, 0);
-
-        const ItemReference what("all cart");
-
-        long cart_burden = 0;
-        for(long no=0; (no = room.items.find_item(what.refs.front(),no)) >= 0; )
-        {
-            cart_burden += (room.items.Items[no].cart->burden() + 10) / 5;
-
-            // Can't use room.items.move() here, because technically
-            // the cart is "immovable". Do the move manually.
-            target.items.Items.push_front(room.items.Items[no]);
-            room.items.Items.erase( room.items.Items.begin() + no );
+        std::uint64_t key;
+        Node*         next;
+        Chunk         chunk;
+        Node(std::uint64_t key, Node* next) : key(key), next(next) {}
+    };
+    std::unique_ptr<std::atomic<Node*>[]> buckets;
+    std::size_t mask;
+    std::atomic<std::size_t> size{0};
 
-            // Only pull the first cart.
-            // The "push_front" above ensures that when coming to
-            // a room with carts in it, you'll continue pulling the
-            // same cart instead of switching to another one.
-            break;
-        }
+    // The number of buckets must be a power of two.
+    explicit ChunkTable(std::size_t n) : buckets(new std::atomic<Node*>[n]()), mask(n-1) {}
+    ~ChunkTable() { Clear(); }
+    ChunkTable(const ChunkTable&) = delete;
+    void operator=(const ChunkTable&) = delete;
 
-        if(cart_burden)
+    Chunk* Find(std::uint64_t key) const
+    {
+        for(Node* n = buckets[RoomRandom::Mix(key) & mask].load(std::memory_order_acquire); n; n = n->next)
+            if(n->key == key) return &n->chunk;
+        return nullptr;
+    }
+    // Find a chunk, or add an empty one if there is none. A node is
+    // only allocated when the chunk is not there.
+    Chunk& Insert(std::uint64_t key)
+    {
+        auto& head = buckets[RoomRandom::Mix(key) & mask];
+        Node* seen = head.load(std::memory_order_acquire);
+        for(Node* n = seen; n; n = n->next)
+            if(n->key == key) return n->chunk;
+        std::unique_ptr<Node> node(new Node(key, seen));
+        while(!head.compare_exchange_weak(node->next, node.get(),
+                                          std::memory_order_release, std::memory_order_acquire))
         {
-            //term << "Pulling that cart wears you down by %ld extra points.\n"_f % cart_burden;
-            burden += cart_burden;
+            // Look through what was added since the head that was seen.
+            for(Node* n = node->next; n != seen; n = n->next)
+                if(n->key == key) return n->chunk;
+            seen = node->next;
         }
+        ++size;
+        return node.release()->chunk;
     }
+    void Clear()
+    {
+        for(std::size_t b=0; b<=mask; ++b)
+            for(Node* n = buckets[b].exchange(nullptr); n; ) { Node* next = n->next; delete n; n = next; }
+        size = 0;
+    }
+    void Remove(std::uint64_t key)
+    {
+        auto& head = buckets[RoomRandom::Mix(key) & mask];
+        for(Node* prev = nullptr, *n = head.load(); n; prev = n, n = n->next)
+            if(n->key == key)
+            {
+                if(prev) prev->next = n->next; else head.store(n->next);
+                delete n; --size;
+                return;
+            }
+    }
+    template<typename F>
+    void ForEach(F&& f) const
+    {
+        for(std::size_t b=0; b<=mask; ++b)
+            for(Node* n = buckets[b].load(std::memory_order_acquire); n; n = n->next)
+                f(n->key, n->chunk);
+    }
+};
 
-    x += xd;
-    y += yd;
-    EatLife(burden);
-
-    return true;
-}
-
-static void Inv()
+// Generate the contents of a new room. They do not depend on the rooms
+// next to it (unlike its walls and environment), so they can be drawn
+// ahead of time by the Pregenerator, with the same results.
+static Eq RoomContents(long x,long y)
 {
-    auto p = eq.print(true);
-    if(!p.second) term << "You are carrying nothing.\n";
-    else          term << p.first << "\n";
+    RoomRandom rnd(x,y, 1);
+    Eq items;
+    float chestrand = frand();
+    // Generate a few items in the room.
+    items.clear(unsigned(std::pow(frand(), 40.0) * 8.5), rnd);
+    // Sometimes make a chest too.
+    if(chestrand < 0.1f) { ItemType i(rnd); i.chest = 1.f; items.push_front(i); }
+    // Sometimes make a cart.
+    if(frand() < 0.005f) { ItemType i(rnd); i.cart.reset(new Eq); items.push_front(i); }
+    return items;
 }
 
-static void LookAtIn(const Eq& where, const ItemReference& what,
-                     const std::string& here_str = "here")
+// A pool of worker threads that draw the contents of whole chunks
+// ahead of the player. Each worker takes chunks from its own queue,
+// and steals from the others when it runs out. The maze takes the
+// results when it gets to make those rooms; everything else about
+// the rooms is still decided by the maze in the order it makes them.
+struct Pregenerator
 {
-    // Look at items in the room.
-    for(const auto& w: what.refs)
+    typedef std::unordered_map<unsigned, Eq> Contents; // Only nonempty rooms
+
+    // The chunks drawn for one maze. Shared with the workers, so that
+    // the maze can go away while some of its chunks are being drawn.
+    struct Store
     {
-        std::pair<std::string,float> output;
-        auto AddItems = [&output](const std::pair<std::string,float>& src)
+        std::mutex lock;    // Guards the following
+        std::unordered_map<std::uint64_t, Contents> ready;
+        std::unordered_set<std::uint64_t> requested;
+
+        // If the contents of this room were drawn already, move them to "items".
+        // Once every room that has something in it is taken, the chunk
+        // is let go of; its empty rooms are as easily generated again.
+        // If the chunk is not ready, the maze makes it itself, and
+        // whatever is drawn for it later is thrown away.
+        bool Take(long x,long y, Eq& items)
         {
-            output.first  += src.first;
-            output.second += src.second;
-        };
-
-        for(long no=0; (no = where.find_item(w,no)) >= 0; )
+            std::lock_guard<std::mutex> l(lock);
+            auto i = ready.find(Chunk::Key(x,y));
+            if(i == ready.end()) { requested.erase(Chunk::Key(x,y)); return false; }
+            auto j = i->second.find(Chunk::Cell(x,y));
+            if(j != i->second.end()) { items = std::move(j->second); i->second.erase(j); }
+            if(i->second.empty()) { requested.erase(i->first); ready.erase(i); }
+            return true;
+        }
+        // Let go of what was drawn or asked for the chunks that are not wanted.
+        // Their contents will be generated again if they are needed after all.
+        template<typename F>
+        void Forget(F&& unwanted)
         {
-            AddItems(where.look_item(no++,what.IsSpecific()));
-            if(what.IsSpecific()) break;
+            std::lock_guard<std::mutex> l(lock);
+            for(auto i = ready.begin(); i != ready.end(); )
+                if(unwanted(i->first)) i = ready.erase(i); else ++i;
+            for(auto i = requested.begin(); i != requested.end(); )
+                if(unwanted(*i)) i = requested.erase(i); else ++i;
         }
+    };
+    struct Task { std::uint64_t key; std::shared_ptr<Store> store; };
 
-        // Look at money in the room, if there were no items or we're looking at everything.
-        if(what.everything || output.first.empty())
-            for(long no=0; (no = where.find_money(w,no)) >= 0; )
-            {
-                AddItems(where.look_money(no++,what.IsSpecific()));
-                if(what.IsSpecific()) break;
-            }
+    struct Queue { std::mutex lock; std::deque<Task> tasks; };
+    std::unique_ptr<Queue[]>        queues;
+    std::vector<std::thread>        workers;
+    std::once_flag                  started;
+    std::atomic<unsigned>           pending{0}, next{0};
 
-        if(here_str == "here")
-        {
-            bool room_empty = output.first.empty();
+    std::mutex                      lock;   // Guards "done", and sleeping
+    std::condition_variable         wakeup;
+    bool                            done = false;
 
-            // Look at inventory items, if there was nothing particular in the room.
-            if(output.first.empty())
-                for(long no=0; (no = eq.find_item(w,no)) >= 0; )
-                {
-                    AddItems(eq.look_item(no++,what.IsSpecific()));
-                    if(what.IsSpecific()) break;
-                }
+    ~Pregenerator()
+    {
+        { std::lock_guard<std::mutex> l(lock); done = true; }
+        wakeup.notify_all();
+        for(auto& t: workers) t.join();
+    }
 
-            // Look at inventory money, if...
-            if(output.first.empty() || (what.everything && room_empty))
-                for(long no=0; (no = eq.find_money(w,no)) >= 0; )
-                {
-                    AddItems(eq.look_money(no++,what.IsSpecific()));
-                    if(what.IsSpecific()) break;
-                }
+    void Request(const std::shared_ptr<Store>& store, std::uint64_t key)
+    {
+        {
+            std::lock_guard<std::mutex> l(store->lock);
+            if(!store->requested.insert(key).second) return;
         }
+        std::call_once(started, [this]{ Start(); });
+        // Counted before it is queued, so that a worker cannot take it first.
+        { std::lock_guard<std::mutex> l(lock); ++pending; }
+        Queue& q = queues[next++ % workers.size()];
+        { std::lock_guard<std::mutex> l(q.lock); q.tasks.push_back({key, store}); }
+        wakeup.notify_one();
+    }
 
-        if(!what.IsSpecific() && !output.first.empty())
+    void Start()
+    {
+        unsigned n = std::max(1u, std::min(4u, std::thread::hardware_concurrency() - 1));
+        queues.reset(new Queue[n]);
+        for(unsigned w=0; w<n; ++w) workers.emplace_back([this,w,n]{ Work(w, n); });
+    }
+    bool Pop(unsigned w, unsigned n, Task& task)
+    {
+        // Newest work from our own queue first, then the oldest from others.
+        for(unsigned o=0; o<n; ++o)
         {
-            if(output.second < 1.f)
-                output.first += "It is of no sales value at all.\n";
-            else
-                output.first += "You estimate that with them you could probably buy %s.\n"_f
-                                % Appraise(output.second, 1, 1);
+            Queue& q = queues[(w+o) % n];
+            std::lock_guard<std::mutex> l(q.lock);
+            if(q.tasks.empty()) continue;
+            if(o == 0) { task = std::move(q.tasks.back());  q.tasks.pop_back(); }
+            else       { task = std::move(q.tasks.front()); q.tasks.pop_front(); }
+            --pending;
+            return true;
         }
-
-        if(!output.first.empty())
-            term << output.first;
-        else
-            if(what.IsSpecific())
-                term << "There %s no %s %s that you can look at.\n"_f
-                        % (w.what.back()=='s' ? "are" : "is")
-                        % w.what
-                        % here_str;
-            else
-                term << "There is nothing %s.\n"_f % here_str;
+        return false;
     }
-}
-
-static void LookAt(const ItemReference& what, const ItemReference& where)
-{
-    const Room &room = maze.GenerateRoom(x,y, defaultroom, 0);
-
-    if(where.refs.empty())
-        LookAtIn(room.items, what);
-    else
+    void Work(unsigned w, unsigned n)
     {
-        unsigned n_sources = 0;
-        for(const auto& w: where.refs)
+        for(;;)
         {
-            unsigned n = 0;
-            for(long no=0; (no = room.items.find_item(w,no)) >= 0; ++n)
+            Task task;
+            if(!Pop(w, n, task))
             {
-                const auto& container = room.items.Items[no++];
-                if(container.chest > 0.f)
-                {
-                    term << "You cannot see inside a closed chest!\n";
-                    continue;
-                }
-                if(!container.cart)
-                {
-                    term << UCfirst("%s does not contain anything!\n"_f
-                                    % AddArticle(container.name(1,1), true));
-                    continue;
-                }
-                LookAtIn(*container.cart, what,
-                         "in %s"_f % AddArticle(container.name(0,1), true));
+                std::unique_lock<std::mutex> l(lock);
+                wakeup.wait(l, [&]{ return done || pending > 0; });
+                if(done) return;
+                continue;
             }
-
-            if(!n && room.items.find_money(w,0) >= 0)
+            // Nobody is waiting for chunks of a maze that is gone.
+            if(task.store.use_count() == 1) continue;
+            long x0 = long(std::int32_t(task.key >> 32)) * Chunk::Size;
+            long y0 = long(std::int32_t(task.key))       * Chunk::Size;
+            Contents contents;
+            for(unsigned c=0; c<Chunk::Cells; ++c)
             {
-                term << "You cannot look inside money! They do not contain anything.\n";
-                ++n;
+                Eq items = RoomContents(x0 + c%Chunk::Size, y0 + c/Chunk::Size);
+                if(!items.Items.empty()) contents.emplace(c, std::move(items));
             }
-            if(!n && !where.everything)
-                term << "Look where? There is no %s in this room!\n"_f % w.what;
-            n_sources += n;
+            std::lock_guard<std::mutex> l(task.store->lock);
+            if(task.store->requested.count(task.key)) task.store->ready.emplace(task.key, std::move(contents));
         }
-        if(!n_sources && where.everything)
-            term << "There is nothing in this room!\n";
     }
-}
+} static pregen;
 
-static void GetFrom(Eq& source, const ItemReference& what,
-                    const std::string& from_str = "",
-                    const std::string& here_str = "here")
+// Chunks and items are put away as plain bytes.
+template<typename T>
+static void Pack(std::string& out, T value)
 {
-    // Move stuff from room to the inventory.
-    auto moved = source.move(eq, what);
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+template<typename T>
+static T Unpack(const char*& p)
+{
+    T value;
+    std::memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return value;
+}
+static void PackItems(std::string& out, const Eq& eq)
+{
+    Pack<std::uint32_t>(out, eq.Items.size());
+    for(const auto& i: eq.Items)
+    {
+        Pack(out, i.type); Pack(out, i.build); Pack(out, i.condition); Pack(out, i.chest);
+        Pack<std::uint8_t>(out, bool(i.cart));
+        if(i.cart) PackItems(out, *i.cart);
+    }
+    // Only the kinds of coins that there are.
+    std::uint8_t coins = 0;
+    for(std::size_t m=0; m<count(MoneyTypes); ++m) if(eq.Money[m]) coins |= 1u << m;
+    Pack(out, coins);
+    for(long m: eq.Money) if(m) Pack<std::int64_t>(out, m);
+}
+// Reads what Pack() wrote, from a file that may have been cut short or
+// damaged. Once anything is wrong, "ok" is false and everything else
+// reads as zero.
+struct Unpacker
+{
+    const char* p;
+    const char* end;
+    bool ok = true;
 
-    if(!moved.immovable.empty() && !what.everything)
-        term << UCfirst("%s could not be moved!\n"_f
-                        % ListWithCounts( std::move(moved.immovable) ));
+    Unpacker(const char* p, const char* end) : p(p), end(end) {}
+    Unpacker(std::string_view data) : p(data.data()), end(data.data() + data.size()) {}
 
-    if(!moved.notfound.empty())
+    template<typename T>
+    T Get()
     {
-        if(moved.notfound.empty())
-            term << "There is nothing %s you can take!\n"_f % here_str;
-        else
-            term << "There is no %s %s!\n"_f
-                    % ListWithCounts( std::move(moved.notfound) ) % here_str;
+        if(!Check(std::size_t(end - p) >= sizeof(T))) return T();
+        return Unpack<T>(p);
     }
-
-    if(!moved.moved.empty())
+    bool Check(bool condition)
     {
-        auto num = moved.moved.size();
-        std::string explanation = ListWithCounts( std::move(moved.moved) );
-        term << "You take %s%s.\n"_f % explanation % from_str;
-        // Eat two hitpoints for every item moved.
-        EatLife(num * 2);
+        if(!condition) { ok = false; p = end; }
+        return ok;
     }
-    else
+    // Whether there is room for "n" things of at least "size" bytes.
+    bool Fits(std::uint64_t n, std::size_t size)
+    {
+        return Check(n <= std::size_t(end - p) / size);
+    }
+};
+static bool UnpackItems(Unpacker& in, Eq& eq, bool in_cart = false)
+{
+    eq.clear();
+    auto n = in.Get<std::uint32_t>();
+    // Every item takes at least 8 bytes: its attributes, the chest and the cart flag.
+    if(!in.Fits(n, 8)) return false;
+    std::vector<ItemType> items;
+    items.reserve(n);
+    for(; n > 0; --n)
     {
-        term << "Nothing taken%s.\n"_f % from_str;
+        auto type = in.Get<std::uint8_t>(), build = in.Get<std::uint8_t>(), condition = in.Get<std::uint8_t>();
+        ItemType& i = items.emplace_back(type, build, condition);
+        i.chest = in.Get<float>();
+        bool cart = in.Get<std::uint8_t>();
+        // Carts cannot be put in carts.
+        if(!in.Check(type < count(ItemTypes) && build < count(BuildTypes) && condition < count(CondTypes)
+                  && std::isfinite(i.chest) && !(cart && in_cart)))
+            return false;
+        if(cart) { i.cart.reset(new Eq); if(!UnpackItems(in, *i.cart, true)) return false; }
     }
+    eq.assign(std::move(items));
+    auto coins = in.Get<std::uint8_t>();
+    if(!in.Check(coins >> count(MoneyTypes) == 0)) return false;
+    for(std::size_t m=0; m<count(MoneyTypes); ++m)
+        if(coins >> m & 1)
+        {
+            eq.Money[m] = in.Get<std::int64_t>();
+            if(!in.Check(eq.Money[m] > 0)) return false;
+        }
+    return in.ok;
 }
 
-static void Get(const ItemReference& what, const ItemReference& where)
+// The chunks that a maze has put away, in a temporary file. Each chunk
+// has a slot in the file, with some room to grow. A chunk that changed
+// after it was put away is written over its old copy if it still fits
+// there, or else into the smallest free slot that it fits in, or at the
+// end of the file, and its old slot is freed. When the free slots take
+// more of the file than the others, the chunks are copied to a new file
+// without them. So the file does not grow with the number of changes.
+struct ChunkStore
 {
-    Room &room = maze.GenerateRoom(x,y, defaultroom, 0);
+    struct Slot { long offset; std::uint32_t length, capacity; };
 
-    if(where.refs.empty())
-        GetFrom(room.items, what);
-    else
+    std::unique_ptr<std::FILE, int(*)(std::FILE*)> file{nullptr, std::fclose};
+    std::unordered_map<std::uint64_t, Slot> index;
+    std::multimap<std::uint32_t, long> free;    // Capacity, offset of slots not in use
+    long end = 0, held = 0, used = 0;           // Bytes in the file, in slots in use, and in chunks
+
+    bool Has(std::uint64_t key) const { return index.count(key); }
+    bool Write(std::uint64_t key, const std::string& data)
     {
-        unsigned n_sources = 0;
-        for(const auto& w: where.refs)
+        if(!file) file.reset(std::tmpfile());
+        if(!file) return false;
+        auto length = std::uint32_t(data.size());
+        auto i = index.find(key);
+        Slot slot = { end, length, (length + length/8 + 15) & ~15u };
+        bool in_place = i != index.end() && length <= i->second.capacity;
+        auto f = free.lower_bound(length);
+        if(in_place)            slot = { i->second.offset, length, i->second.capacity };
+        else if(f != free.end()) slot = { f->second, length, f->first };
+        if(std::fseek(file.get(), slot.offset, SEEK_SET) != 0
+        || std::fwrite(data.data(), 1, data.size(), file.get()) != data.size())
+            return false;
+
+        if(i != index.end())
         {
-            unsigned n = 0;
-            for(long no=0; (no = room.items.find_item(w,no)) >= 0; ++n)
-            {
-                auto& container = room.items.Items[no++];
-                if(container.chest > 0.f)
-                {
-                    term << "You cannot get anything from a closed chest.\n";
-                    continue;
-                }
-                if(!container.cart)
-                {
-                    term << "You cannot take things from %s.\n"_f
-                        % AddArticle(container.name(0,1), true);
-                    continue;
-                }
-                GetFrom(*container.cart, what,
-                        " from %s"_f % AddArticle(container.name(0,1), true),
-                        "in %s"_f % AddArticle(container.name(0,1), true) );
-            }
-            if(!n && !where.everything)
-                term << "Take from where? There is no %s in this room!\n"_f % w.what;
-            n_sources += n;
+            used -= i->second.length;
+            held -= i->second.capacity;
+            if(!in_place) free.emplace(i->second.capacity, i->second.offset);
         }
-        if(!n_sources && where.everything)
-            term << "There is nothing in this room!\n";
+        if(!in_place && f != free.end()) free.erase(f);
+        if(slot.offset == end) end += slot.capacity;
+        used += length;
+        held += slot.capacity;
+        index[key] = slot;
+        if(end - held > held && end > 65536) Compact();
+        return true;
     }
-}
-
-static void PutTo(Eq& target, const ItemReference& what,
-                  const std::string& targetname = "")
-{
-    // Move stuff from inventory to the specified destination.
-    auto moved = eq.move(target, what);
-
-    if(!moved.immovable.empty())
-        term << UCfirst("%s could not be moved!\n"_f
-                        % ListWithCounts( std::move(moved.immovable) ));
-
-    if(!moved.notfound.empty())
+    // Copy the chunks to a new file, one after another. If that fails,
+    // the old file is kept.
+    void Compact()
     {
-        if(moved.notfound.empty())
-            term << "You don't have anything!\n";
-        else
-            term << "You don't have %s!\n"_f
-                    % ListWithCounts( std::move(moved.notfound) );
+        std::unique_ptr<std::FILE, int(*)(std::FILE*)> to{std::tmpfile(), std::fclose};
+        if(!to) return;
+        auto moved = index;
+        std::string data;
+        long at = 0;
+        for(auto& i: moved)
+        {
+            if(!Read(i.first, data) || std::fseek(to.get(), at, SEEK_SET) != 0
+            || std::fwrite(data.data(), 1, data.size(), to.get()) != data.size())
+                return;
+            i.second.offset = at;
+            at += i.second.capacity;
+        }
+        file  = std::move(to);
+        index = std::move(moved);
+        free.clear();
+        end = at;
     }
-
-    if(!moved.moved.empty())
+    bool Read(std::uint64_t key, std::string& data)
     {
-        auto num = moved.moved.size();
-        std::string explanation = ListWithCounts( std::move(moved.moved) );
-        if(targetname.empty())
-            term << "You drop %s.\n"_f % explanation;
-        else
-            term << "You put %s in %s.\n"_f % explanation % targetname;
-        // Eat half hitpoint for every item dropped.
-        EatLife(num / 2);
+        auto i = index.find(key); if(i == index.end()) return false;
+        data.resize(i->second.length);
+        return std::fseek(file.get(), i->second.offset, SEEK_SET) == 0
+            && std::fread(&data[0], 1, data.size(), file.get()) == data.size();
     }
-    else
-        term << "Nothing moved.\n";
-}
+};
 
-static void Put(const ItemReference& what, const ItemReference& where)
+// A saved game, which is read directly from the file. It begins with
+// the state of the player, followed by an index of the chunks of the
+// maze, sorted by key, and the chunks themselves. Chunks are saved
+// as by Maze::Save(), and they are not looked at until they are needed.
+struct Snapshot
 {
-    Room &room = maze.GenerateRoom(x,y, defaultroom, 0);
-
-    if(where.refs.empty())
+    static constexpr char     Magic[8] = { 'D','U','N','G','E','O','N','\0' };
+    static constexpr unsigned Version  = 1;
+    // An index entry: key, offset from the beginning of the file, length
+    enum : std::size_t { EntrySize = 8 + 8 + 4 };
+
+    const char*  data = nullptr;
+    std::size_t  size = 0;
+    const char*  index = nullptr; // Where the index begins
+    std::size_t  chunks = 0;
+#ifndef __linux__
+    std::string  contents;        // The whole file, where it cannot be mapped
+#endif
+
+    Snapshot() = default;
+    Snapshot(const Snapshot&) = delete;
+    void operator=(const Snapshot&) = delete;
+    ~Snapshot()
     {
-        PutTo(room.items, what);
+#ifdef __linux__
+        if(data) munmap(const_cast<char*>(data), size);
+#endif
     }
-    else
+
+    // Map the file, and check that it is a game saved by this version.
+    // Returns the position where the state of the player begins.
+    const char* Open(const std::string& filename)
     {
-        if(!where.IsSpecific())
+#ifdef __linux__
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0) return nullptr;
+        struct stat st;
+        if(fstat(fd, &st) == 0 && st.st_size > 0)
         {
-            term << "Put where exactly? \"%s\" is rather vague.\n"_f % where.original;
-            return;
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p != MAP_FAILED) { data = static_cast<const char*>(p); size = st.st_size; }
         }
-
-        long container_no = room.items.find_item(where.refs.front());
-        if(container_no < 0)
+        close(fd);
+#else
+        std::unique_ptr<std::FILE, int(*)(std::FILE*)> file(std::fopen(filename.c_str(), "rb"), std::fclose);
+        if(!file) return nullptr;
+        char buffer[65536];
+        for(std::size_t n; (n = std::fread(buffer, 1, sizeof(buffer), file.get())) > 0; ) contents.append(buffer, n);
+        data = contents.data(); size = contents.size();
+#endif
+        if(size < sizeof(Magic) + 4 || std::memcmp(data, Magic, sizeof(Magic)) != 0) return nullptr;
+        const char* p = data + sizeof(Magic);
+        if(Unpack<std::uint32_t>(p) != Version) return nullptr;
+        return p;
+    }
+    // After the state of the player, find the index.
+    bool OpenIndex(const char* p)
+    {
+        if(p + 8 > data + size) return false;
+        chunks = Unpack<std::uint64_t>(p);
+        index  = p;
+        return chunks <= std::size_t(data + size - index) / EntrySize;
+    }
+    // Find a saved chunk.
+    bool Find(std::uint64_t key, std::string_view& chunk) const
+    {
+        std::size_t begin = 0, end = chunks;
+        while(begin < end)
         {
-            term << "Put in where? There is no %s in this room!\n"_f % where.original;
-            return;
+            std::size_t mid = (begin + end) / 2;
+            const char* p = index + mid * EntrySize;
+            auto k = Unpack<std::uint64_t>(p);
+            if(k < key) { begin = mid+1; continue; }
+            if(k > key) { end = mid; continue; }
+            auto offset = Unpack<std::uint64_t>(p);
+            auto length = Unpack<std::uint32_t>(p);
+            if(offset > size || length > size - offset) return false;
+            chunk = std::string_view(data + offset, length);
+            return true;
         }
-        auto& container = room.items.Items[container_no];
-        if(container.chest > 0.f)
+        return false;
+    }
+    template<typename F>
+    void ForEach(F&& f) const
+    {
+        for(const char* p = index; p != index + chunks * EntrySize; p += EntrySize)
         {
-            term << "You cannot put things in a closed chest.\n";
-            return;
+            const char* q = p;
+            f(Unpack<std::uint64_t>(q));
         }
-        if(!container.cart)
+    }
+};
+
+struct Maze
+{
+    // Many players can share a maze. Then the contents of a room are
+    // only touched while holding its chunk's lock (see Lock()), and new
+    // rooms are made while holding it. Rooms that exist can be looked
+    // at without locking, because only their contents ever change.
+    bool shared;
+    // A maze contains rooms, in chunks keyed by chunk coordinates.
+    ChunkTable chunks;
+    // Contents of rooms drawn ahead of time, if that is wanted at all.
+    std::shared_ptr<Pregenerator::Store> pregenerated = std::make_shared<Pregenerator::Store>();
+
+    // Ask for the chunks around the point some distance ahead
+    // in the direction that the player is going.
+    void Ahead(long x,long y, int xd,int yd)
+    {
+        if(!pregenerated) return;
+        x += xd * long(Chunk::Size);
+        y += yd * long(Chunk::Size);
+        // Chunks that the maze has begun making, or has put away, are not drawn again.
+        for(int p=0; p<9; ++p)
         {
-            term << "You cannot put things in %s.\n"_f % AddArticle(container.name(0,1), true);
-            return;
+            auto key = Chunk::Key(x + (p%3-1) * long(Chunk::Size), y + (p/3-1) * long(Chunk::Size));
+            if(!chunks.Find(key) && !Saved(key)) pregen.Request(pregenerated, key);
         }
-        PutTo(*container.cart, what, AddArticle(container.name(0,1), true));
     }
-}
 
-static void Open(const ItemReference& what, const ItemReference& withwhat)
-{
-    Room &room = maze.GenerateRoom(x,y, defaultroom, 0);
+    // A maze that is not shared keeps at most this many chunks in memory
+    // (or any number, if this is 0), and puts the rest away in "store".
+    std::size_t budget;
+    ChunkStore store;
+    unsigned long clock = 0, put_away = 0, brought_back = 0;
+    // The game that the maze was restored from, if any.
+    std::unique_ptr<Snapshot> snapshot;
+
+    explicit Maze(bool shared = false)
+        : shared(shared), chunks(shared ? 1u << 16 : 1u << 8), budget(shared ? 0 : 1024) {}
+
+    // How many rooms asked for were already there, and how many had to
+    // be generated. CanMoveTo() and SpawnRooms() ask about plenty of them.
+    // Each game counts its own, even when players share a maze and a
+    // thread: while a game runs, "counting" points to its counters.
+    struct Stats
+    {
+        unsigned long hits = 0, misses = 0;
+        Stats operator-(const Stats& b) const { return { hits - b.hits, misses - b.misses }; }
+    };
+    static thread_local Stats* counting;
+    struct Counting
+    {
+        Stats* previous;
+        explicit Counting(Stats& stats) : previous(counting) { counting = &stats; }
+        ~Counting() { counting = previous; }
+        Counting(const Counting&) = delete;
+        void operator=(const Counting&) = delete;
+    };
 
-    if(!what.IsSpecific())
+    // Lock the chunk of the room, if the maze is shared.
+    std::unique_lock<std::recursive_mutex> Lock(const Chunk& chunk) const
     {
-        term << "Open what exactly? \"%s\" is rather vague.\n"_f % what.original;
-        return;
+        return shared ? std::unique_lock<std::recursive_mutex>(chunk.lock)
+                      : std::unique_lock<std::recursive_mutex>();
     }
-    if(!withwhat.refs.empty() && !withwhat.IsSpecific())
+    std::unique_lock<std::recursive_mutex> Lock(long x,long y)
     {
-        term << "Use what exactly? \"%s\" is rather vague.\n"_f % withwhat.original;
-        return;
+        return Lock(At(Chunk::Key(x,y)));
+    }
+    // Lock the chunks of two rooms, always in the same order.
+    std::pair<std::unique_lock<std::recursive_mutex>, std::unique_lock<std::recursive_mutex>>
+        Lock(long x1,long y1, long x2,long y2)
+    {
+        std::uint64_t k1 = Chunk::Key(x1,y1), k2 = Chunk::Key(x2,y2);
+        if(k2 < k1) { std::swap(x1,x2); std::swap(y1,y2); }
+        auto first = Lock(x1,y1);
+        return { std::move(first), Lock(x2,y2) };
     }
 
-    long chest_no = room.items.find_item(what.refs.front());
-    if(chest_no < 0)
+    // Generate a room at given coordinates.
+    // The "model" room will help the maze generator generate
+    // similar rooms in nearby locations.
+    // Returns the chunk where the room is, at Chunk::Cell(x,y).
+    Chunk& Generate(long x,long y, const Room& model, unsigned seed)
     {
-        term << "There is no %s to open in this room!\n"_f % what.original;
-        return;
+        Chunk& chunk = At(Chunk::Key(x,y));
+        unsigned c = Chunk::Cell(x,y);
+        if(chunk.Generated(c)) { if(counting) ++counting->hits; return chunk; }
+        auto lock = Lock(chunk);
+        if(chunk.Generated(c)) { if(counting) ++counting->hits; return chunk; }
+        if(counting) ++counting->misses;
+        Make(chunk, c, x,y, model, seed);
+        return chunk;
     }
-    auto& open_item = room.items.Items[chest_no];
-    if(open_item.chest <= 0.f)
+    // Make a new room directly into the chunk.
+    void Make(Chunk& chunk, unsigned c, long x,long y, const Room& model, unsigned seed)
     {
-        term << UCfirst("%s is not particularly in need of opening.\n"_f
-                        % AddArticle(open_item.name(1,1), true));
-        return;
+        // Everything in the room is drawn from its own generator,
+        // so the order in which rooms are made does not matter.
+        RoomRandom rnd(x,y);
+        auto& Wall = chunk.Wall[c] = model.Wall;
+        auto& Env  = chunk.Env[c]  = model.Env;
+        auto& Seed = chunk.seed[c] = (seed + (frand() > 0.95 ? rand(4) : 0)) & 3;
+        // 10% chance for the environment type to change.
+        if(frand() > 0.9) Env = rand(count(EnvTypes));
+        if(frand() > (seed==model.seed ? 0.95 : 0.1))
+            Wall = frand() < 0.4 ? 2 : 0;
+        // The contents may have been drawn in the background already.
+        Eq items;
+        if(!pregenerated || !pregenerated->Take(x,y, items)) items = RoomContents(x,y);
+
+        // Only rooms with something in them need a complete record.
+        if(!items.Items.empty())
+        {
+            Room& room = chunk.rooms[c];
+            room.Wall  = Wall;
+            room.Env   = Env;
+            room.seed  = Seed;
+            room.items = std::move(items);
+            chunk.SetStored(c);
+        }
+        chunk.SetGenerated(c);
+        chunk.dirty = true;
+        if(chunk.mapped) chunk.map[c] = chunk.Char(c);
     }
-
-    // If the player tries to use an implement to open the chest,
-    // check whether they do in fact possess such a device.
-    long item_no = -1;
-
-    if(!withwhat.refs.empty())
+    // Generate a room at given coordinates, and return it with its contents.
+    // In a shared maze, the caller must hold the lock of the room's chunk
+    // for as long as it uses the contents.
+    Room& GenerateRoom(long x,long y, const Room& model, unsigned seed)
     {
-        item_no = eq.find_item(withwhat.refs.front());
-        if(item_no < 0)
+        Chunk& chunk = Generate(x,y, model, seed);
+        unsigned c = Chunk::Cell(x,y);
+        auto lock = Lock(chunk);
+        if(!chunk.Stored(c))
         {
-            term << "You don't have any %s!\n"_f % withwhat.original;
-            return;
+            Room& room = chunk.rooms[c];
+            room.Wall = chunk.Wall[c];
+            room.Env  = chunk.Env[c];
+            room.seed = chunk.seed[c];
+            chunk.SetStored(c);
+            return room;
         }
+        return chunk.rooms.find(c)->second;
     }
-
-    rnd.seed( 71161183 * room.seed + item_no + open_item.chest * 0x8088401
-           + 971697*x + 5197161*y);
-
-    // Evaluate the implement!
-    // The heavier the material and the lighter the item, the more powerful it is.
-    //        e.g. "iron tie" and "gold sceptre" are pretty good,
-    //        and  "silk battlesuit" does not help at all.
-    //   Our own power is equivalent to about "leather sceptre".
-    // The heavier and less costly it is, the less damage it tends to take.
-    //        e.g. "iron hammer" does not take much damage,
-    //        but  "silk cap" is damaged beyond repair at once.
-    //   This is not a perfect measure, for instance glass is more formidable as leather...
-    //   We are about as formidable as "good leather dagger".
-    // The heavier it is, the more effort it takes to use it.
-    float prying_power      = 0.5 / 2.5;                    // 0.2
-    float damage_resistance = (0.5 * 1.5) / (0.9*0.09*0.1); // 92.593
-    long  effort_cost       = 8;
-
-    if(item_no >= 0)
+    // Note that the contents of the room are being changed. The caller
+    // must hold the lock of the room's chunk.
+    void Modify(long x,long y)
     {
-        const auto& item = eq.Items[item_no];
-        prying_power      = BuildTypes[item.build].weight / ItemTypes[item.type].weight;
-        damage_resistance = item.weight() / item.value(1.f);
-        effort_cost       = item.weight();
+        Chunk& chunk = At(Chunk::Key(x,y));
+        chunk.dirty = chunk.modified = true;
+        chunk.mapped = false;
+    }
+    // Draw a rectangle of the maze into "out", one character per room
+    // (see Chunk::Char()), "width" characters per row. Every chunk is
+    // looked up once, and copied a row at a time from its map. Rooms
+    // that have not been generated are left blank.
+    void Render(long left,long top, std::size_t width,std::size_t height, char* out)
+    {
+        const long right = left + long(width), bottom = top + long(height);
+        const long mask = Chunk::Size-1;
+        for(long y = top; y < bottom; y = (y | mask) + 1)
+            for(long x = left, y_end = std::min(bottom, (y | mask) + 1); x < right; x = (x | mask) + 1)
+            {
+                std::size_t n = std::min(right, (x | mask) + 1) - x;
+                char* o = out + (y - top) * width + (x - left);
+                std::uint64_t key = Chunk::Key(x,y);
+                Chunk* chunk = chunks.Find(key);
+                if(!chunk && !shared && Saved(key)) chunk = &At(key);
+                if(!chunk)
+                {
+                    for(long r = y; r < y_end; ++r, o += width) std::memset(o, ' ', n);
+                    continue;
+                }
+                auto lock = Lock(*chunk);
+                const char* map = chunk->Map() + Chunk::Cell(x,y);
+                // Whole rows of a chunk are copied with a constant size.
+                if(n == Chunk::Size)
+                    for(long r = y; r < y_end; ++r, o += width, map += Chunk::Size) std::memcpy(o, map, Chunk::Size);
+                else
+                    for(long r = y; r < y_end; ++r, o += width, map += Chunk::Size) std::memcpy(o, map, n);
+            }
     }
 
-    term << "You try to pry %s open %s.\n"_f
-        % AddArticle(open_item.name(0,0), true)
-        % (item_no < 0 ? "with your bare hands"
-                       : ("using your " + eq.Items[item_no].name(1,1)));
-
-    EatLife(effort_cost);
-
-    open_item.chest -= prying_power * (0.5f + 5.f*std::pow(frand(),4.f));
-
-    if(frand() > 0.75f && frand() > damage_resistance/500.f)
+    // Find a chunk, or bring it back if it was put away, or add an empty one.
+    Chunk& At(std::uint64_t key)
     {
-        // If we are using an implement, the damage may
-        // be transferred into the item instead!
-        bool item_damaged = (item_no >= 0 && frand() >= 0.25f);
-        if(item_damaged)
+        if(shared) return chunks.Insert(key);
+        Chunk* chunk = chunks.Find(key);
+        if(!chunk)
+        {
+            chunk = &chunks.Insert(key);
+            std::string data;
+            std::string_view saved;
+            // A chunk that cannot be read back is generated again.
+            if(store.Read(key, data))                       { if(Restore(*chunk, key, data)) ++brought_back; }
+            else if(snapshot && snapshot->Find(key, saved)) Restore(*chunk, key, saved);
+        }
+        chunk->used = clock;
+        return *chunk;
+    }
+    // Whether a chunk that is not in memory has been saved somewhere.
+    bool Saved(std::uint64_t key) const
+    {
+        std::string_view saved;
+        return store.Has(key) || (snapshot && snapshot->Find(key, saved));
+    }
+    // If there are more chunks than the budget allows, put away those
+    // that were used least recently, until only 3/4 of the budget is in
+    // use. This is done between commands, when no rooms are being used.
+    void Trim()
+    {
+        if(shared) return;
+        ++clock;
+        if(!budget || chunks.size <= budget) return;
+        std::vector<std::pair<unsigned long, std::uint64_t>> order;
+        chunks.ForEach([&](std::uint64_t key, const Chunk& chunk) { order.emplace_back(chunk.used, key); });
+        std::sort(order.begin(), order.end());
+        order.resize(order.size() - budget*3/4);
+        for(const auto& o: order) PutAway(o.second);
+        // Nor keep what was drawn for chunks that are not in memory.
+        if(pregenerated) pregenerated->Forget([&](std::uint64_t key) { return !chunks.Find(key); });
+    }
+    void PutAway(std::uint64_t key)
+    {
+        Chunk& chunk = *chunks.Find(key);
+        if(chunk.dirty || !Saved(key))
+        {
+            std::string data;
+            Save(chunk, data);
+            // Keep the chunk if it cannot be put away.
+            if(!store.Write(key, data)) return;
+        }
+        chunks.Remove(key);
+        ++put_away;
+    }
+    // The walls and the environment of a room depend on the rooms that
+    // were there before it, so they are always saved (in two bytes).
+    // Contents are saved only if some have been changed, because others
+    // can be generated again.
+    static void Save(const Chunk& chunk, std::string& out)
+    {
+        for(const auto& g: chunk.generated) Pack(out, g.load(std::memory_order_relaxed));
+        for(unsigned c=0; c<Chunk::Cells; ++c)
+            if(chunk.Generated(c))
+            {
+                Pack(out, chunk.Env[c]);
+                Pack<std::uint8_t>(out, chunk.Wall[c] << 2 | chunk.seed[c]);
+            }
+        Pack<std::uint8_t>(out, chunk.modified);
+        if(!chunk.modified) return;
+        Pack<std::uint16_t>(out, chunk.rooms.size());
+        for(const auto& r: chunk.rooms)
         {
-            auto& item = eq.Items[item_no];
-            std::string name = item.name(1,1);
-            if(++item.condition >= count(CondTypes))
+            Pack<std::uint8_t>(out, r.first);
+            PackItems(out, r.second.items);
+        }
+    }
+    // Returns false if the data is damaged. Then the chunk is left empty.
+    static bool Restore(Chunk& chunk, std::uint64_t key, std::string_view data)
+    {
+        long x0 = long(std::int32_t(key >> 32)) * Chunk::Size;
+        long y0 = long(std::int32_t(key))       * Chunk::Size;
+        Unpacker in(data);
+        std::uint64_t generated[Chunk::Cells/64];
+        for(auto& g: generated) g = in.Get<std::uint64_t>();
+        for(unsigned c=0; c<Chunk::Cells; ++c)
+            if(generated[c/64] >> (c%64) & 1)
             {
-                term << "`alert`Your %s gets damaged! It is utterly destroyed.\n"_f % name;
-                eq.Items.erase( eq.Items.begin() + item_no );
+                chunk.Env[c]  = in.Get<std::uint8_t>();
+                auto ws       = in.Get<std::uint8_t>();
+                chunk.Wall[c] = ws >> 2;
+                chunk.seed[c] = ws & 3;
+                if(!in.Check(chunk.Env[c] < count(EnvTypes))) break;
             }
-            else
+        if(!in.ok) return false;
+        auto Fail = [&]
+        {
+            chunk.rooms.clear();
+            for(auto& s: chunk.stored) s.store(0, std::memory_order_relaxed);
+            chunk.modified = false;
+            return false;
+        };
+        auto AddRoom = [&](unsigned c) -> Room&
+        {
+            Room& room = chunk.rooms[c];
+            room.Wall = chunk.Wall[c];
+            room.Env  = chunk.Env[c];
+            room.seed = chunk.seed[c];
+            chunk.SetStored(c);
+            return room;
+        };
+        chunk.modified = in.Get<std::uint8_t>();
+        if(chunk.modified)
+        {
+            // Every room takes at least 6 bytes: its cell, the number of
+            // items and the kinds of coins.
+            auto n = in.Get<std::uint16_t>();
+            if(!in.Check(n <= Chunk::Cells) || !in.Fits(n, 6)) return Fail();
+            for(; n > 0; --n)
             {
-                term << "`alert`Your %s gets damaged! It is now in %s condition.\n"_f
-                    % name
-                    % item.GetCondition();
+                unsigned c = in.Get<std::uint8_t>();
+                if(!in.Check(generated[c/64] >> (c%64) & 1) || !UnpackItems(in, AddRoom(c).items)) return Fail();
             }
         }
         else
+            for(unsigned c=0; c<Chunk::Cells; ++c)
+                if(generated[c/64] >> (c%64) & 1)
+                {
+                    Eq items = RoomContents(x0 + c%Chunk::Size, y0 + c/Chunk::Size);
+                    if(!items.Items.empty()) AddRoom(c).items = std::move(items);
+                }
+        if(!in.ok || in.p != in.end) return Fail();
+        for(unsigned w=0; w<Chunk::Cells/64; ++w) chunk.generated[w].store(generated[w], std::memory_order_release);
+        return true;
+    }
+
+    // Save all the chunks, wherever they are, with an index of them
+    // (see Snapshot). Only for mazes that are not shared.
+    void Save(std::string& out)
+    {
+        std::vector<std::uint64_t> keys;
+        chunks.ForEach([&](std::uint64_t key, const Chunk&) { keys.push_back(key); });
+        for(const auto& i: store.index) keys.push_back(i.first);
+        if(snapshot) snapshot->ForEach([&](std::uint64_t key) { keys.push_back(key); });
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+        Pack<std::uint64_t>(out, keys.size());
+        std::size_t index = out.size();
+        out.resize(index + keys.size() * Snapshot::EntrySize);
+        std::string data, entry;
+        for(std::size_t n=0; n<keys.size(); ++n)
         {
-            unsigned sprain = rand(count(BodyParts));
-            EatLife(BodyParts[sprain].worth);
-            term << "You sprain your %s!\n"_f % BodyParts[sprain].name;
+            std::uint64_t offset = out.size();
+            std::string_view saved;
+            if(const Chunk* chunk = chunks.Find(keys[n])) Save(*chunk, out);
+            else if(store.Read(keys[n], data))            out += data;
+            else if(snapshot->Find(keys[n], saved))       out += saved;
+            entry.clear();
+            Pack(entry, keys[n]); Pack(entry, offset); Pack<std::uint32_t>(entry, out.size() - offset);
+            std::memcpy(&out[index + n * Snapshot::EntrySize], entry.data(), entry.size());
         }
     }
-
-    term << "`reset`";
-
-    // Did the chest open?
-    if(open_item.chest > 0.f)
+    // Forget all rooms, to start over. Only for mazes that are not shared.
+    void Clear()
     {
-        term << UCfirst("%s resists your meddling! Try harder.\n"_f
-                        % AddArticle(open_item.name(0,0), true));
-        if(item_no < 0 && frand() < 0.3)
-            term << "Try using a tool: 'open chest using <item>'.\n";
-        return;
+        chunks.Clear();
+        store = ChunkStore();
+        snapshot.reset();
+        if(pregenerated) pregenerated = std::make_shared<Pregenerator::Store>();
     }
+};
+thread_local Maze::Stats* Maze::counting = nullptr;
 
-    open_item.chest = 1.0f; // to make sure the name is properly printed the last time
-    term
-        << UCfirst("%s bursts into pieces!\n"_f % AddArticle(open_item.name(0,0), true))
-        << "Everything it contained is scattered on the ground.\n";
-
-    // Delete the chest from the room.
-    room.items.Items.erase( room.items.Items.begin() + chest_no );
-
-    // Generate the contents of the box. There is at least one item inside.
-    do
-        if(frand() > 0.96) // pure money is rare.
-        {
-            unsigned moneytype((1.0-std::pow(frand(), 4)) * (count(MoneyTypes)-1));
-            room.items.Money[moneytype] += rand(1600/MoneyTypes[moneytype].worth);
-        }
-        else
-            room.items.Items.push_front(ItemType());
-    while(frand() > 0.3);
-}
 
+// Short forms of commands. They are replaced at the beginning of a
+// command, if followed by a space, or if they are a whole "word" (not
+// followed by a letter, a digit or "_").
 struct Alias
 {
-    std::regex  pattern;
-    std::string replacement;
+    std::string_view from, to;
+    bool             word;
 } static const aliases[] =
 {
-    { R"(^l\b)"_r,                     "look"     },
-    { R"(^lat? )"_r,                   "look at " },
-    { R"(^lin? )"_r,                   "look in " },
-    { R"(^look in )"_r,                "look at all in " },
-    { R"(^ga\b)"_r,                    "get all"  },
-    { R"(^da\b)"_r,                    "drop all" },
-    { R"(^d )"_r,                      "drop "    },
-    { R"(^g )"_r,                      "get "     },
-    { R"(^take )"_r,                   "get "     },
-    { R"(^pry )"_r,                    "open "    },
-    { R"(^i\b)"_r,                     "inv"      },
-    { R"(^inventory\b)"_r,             "inv"      },
-    { R"(^da\b)"_r,                    "drop all" },
-    { R"(^put(.*)\b(in|into|to)\b)"_r, "drop$1in" },
-    { R"(\busing\b)"_r,                "with"     },
-    { R"(\bwith my\b)"_r,              "with"     },
-    { R"(^\s+)"_r,                     ""         },
-    { R"(\s+$)"_r,                     ""         }
+    { "l",         "look",            true  },
+    { "la ",       "look at ",        false },
+    { "lat ",      "look at ",        false },
+    { "li ",       "look in ",        false },
+    { "lin ",      "look in ",        false },
+    { "look in ",  "look at all in ", false },
+    { "ga",        "get all",         true  },
+    { "da",        "drop all",        true  },
+    { "d ",        "drop ",           false },
+    { "g ",        "get ",            false },
+    { "take ",     "get ",            false },
+    { "pry ",      "open ",           false },
+    { "i",         "inv",             true  },
+    { "inventory", "inv",             true  }
 };
 
+// The aliases in a trie, so that the beginning of a command is looked
+// up one character at a time. Node 0 is the root. The characters that
+// lead on from a node are in "labels", and the nodes they lead to are
+// at the same positions in "next".
+struct AliasTrie
+{
+    struct Node
+    {
+        std::string           labels;
+        std::vector<unsigned> next;
+        const Alias*          alias = nullptr;
+    };
+    std::vector<Node> nodes{1};
+
+    AliasTrie()
+    {
+        for(const auto& a: aliases)
+        {
+            unsigned n = 0;
+            for(char c: a.from)
+            {
+                auto i = nodes[n].labels.find(c);
+                if(i != std::string::npos) { n = nodes[n].next[i]; continue; }
+                nodes[n].labels += c;
+                nodes[n].next.push_back(nodes.size());
+                n = nodes.size();
+                nodes.emplace_back();
+            }
+            nodes[n].alias = &a;
+        }
+    }
+    // The alias that the command begins with, or null.
+    const Alias* Find(std::string_view cmd) const
+    {
+        const Alias* found = nullptr;
+        for(std::size_t p = 0, n = 0; ; ++p)
+        {
+            const Node& node = nodes[n];
+            if(node.alias && (!node.alias->word || p == cmd.size() || !IsWordChar(cmd[p])))
+                found = node.alias;
+            if(p == cmd.size()) break;
+            auto i = node.labels.find(cmd[p]);
+            if(i == std::string::npos) break;
+            n = node.next[i];
+        }
+        return found;
+    }
+} static const alias_trie;
+
+// Rewrite the aliases in a command. This has the same effect as applying
+// these substitutions of regular expressions in turn until none of them
+// changes anything: the aliases (as ^l\b -> look, ^lat? -> look at, ...),
+// ^put(.*)\b(in|into|to)\b -> drop$1in, \busing\b -> with,
+// \bwith my\b -> with, ^\s+ -> "" and \s+$ -> "". None of the
+// replacements makes another one appear earlier in the command, so one
+// pass is enough. Only leading white space has to be removed before the
+// beginning is looked at, but trailing white space after it: "la " is
+// "look at", but "la" is not anything.
+static void RewriteAliases(std::string& cmd)
+{
+    auto Word = [&cmd](std::size_t at, std::string_view word)
+    {
+        return cmd.compare(at, word.size(), word) == 0
+            && (at + word.size() == cmd.size() || !IsWordChar(cmd[at + word.size()]));
+    };
+    auto Beginning = [&]
+    {
+        // "l in" is "look in", which is "look at all in".
+        while(const Alias* a = alias_trie.Find(cmd)) cmd.replace(0, a->from.size(), a->to);
+
+        // "put X into Y" (and the like) is "drop X in Y", at the last
+        // such word before any line break.
+        if(cmd.compare(0, 3, "put") != 0) return;
+        for(std::size_t p = std::min(cmd.find_first_of("\r\n"), cmd.size()); p-- > 3; )
+            if(!IsWordChar(cmd[p-1]))
+                for(std::string_view in: { "in", "into", "to" })
+                    if(Word(p, in))
+                    {
+                        cmd.replace(p, in.size(), "in");
+                        cmd.replace(0, 3, "drop");
+                        return;
+                    }
+    };
+    auto Space = [](char c) { return std::isspace((unsigned char)c) != 0; };
+    bool indented = !cmd.empty() && Space(cmd[0]);
+    if(!indented) Beginning();
+
+    // "using" and "with my" (and "with my my") are "with".
+    std::size_t out = 0;
+    for(std::size_t p = 0; p < cmd.size(); )
+    {
+        if((p == 0 || !IsWordChar(cmd[p-1])) && (Word(p, "using") || Word(p, "with")))
+        {
+            p += cmd[p] == 'u' ? 5 : 4;
+            while(Word(p, " my")) p += 3;
+            cmd.replace(out, 4, "with");
+            out += 4;
+            continue;
+        }
+        cmd[out++] = cmd[p++];
+    }
+    cmd.resize(out);
+
+    std::size_t first = std::find_if_not(cmd.begin(), cmd.end(), Space) - cmd.begin();
+    std::size_t last  = cmd.rend() - std::find_if_not(cmd.rbegin(), cmd.rend(), Space);
+    if(first < last) { cmd.erase(last); cmd.erase(0, first); }
+    else cmd.clear();
+    if(indented) Beginning();
+}
+
 // A command line history and input engine.
 struct CommandReader
 {
     enum : unsigned { HistLen = 10, HistMin = 5 };
 
+    Term& term;                 // Where the prompt and messages go
     std::deque<std::string> history;
     std::string prompt;
     std::pair<std::string, unsigned> repeat;
+    // Lines given with Feed(). When there are none, an interactive
+    // reader reads std::cin, and others wait for more to be fed.
+    std::deque<std::string> input;
+    bool interactive = true, prompted = false;
+
+    explicit CommandReader(Term& term) : term(term) {}
 
     void SetPrompt(const std::string& s) { prompt = s; }
+    void Feed(const std::string& line) { input.push_back(line); }
 
-    std::string ReadCommand()
+    // Produce the next command into "cmd". Returns false if
+    // a non-interactive reader needs more input first.
+    bool ReadCommand(std::string& cmd)
     {
         for(;;)
         {
-            term << "`prompt`%s`reset``flush`"_f % prompt;
-
-            std::string cmd;
+            if(!prompted) term << "`prompt`%s`reset``flush`"_f % prompt;
+            prompted = true;
 
             if(repeat.second)
             {
                 --repeat.second;
                 cmd = repeat.first;
             }
+            else if(!input.empty())
+            {
+                cmd = std::move(input.front());
+                input.pop_front();
+            }
+            else if(!interactive)
+                return false;
             else
             {
                 std::getline(std::cin, cmd);
-                if(!std::cin.good()) return "quit";
+                if(!std::cin.good()) { cmd = "quit"; return true; }
             }
+            prompted = false;
             if(cmd.empty()) continue;
 
             // Check if the command begins with a number, indicating
@@ -1443,12 +2427,14 @@ struct CommandReader
             std::smatch res;
             if(std::regex_match(cmd, res, "^([1-9][0-9]*) +([^ 1-9].*)"_r))
             {
-                repeat = { res[2], std::stoi(res[1]) };
-                if(repeat.second > 50)
-                {
-                    term << "Ignoring too large repeat count %u\n"_f % repeat.second;
-                    repeat.second = 0;
-                }
+                // Numbers too large to count anything with are as good as infinite.
+                std::string digits = res[1];
+                unsigned long n = 0;
+                if(std::from_chars(digits.data(), digits.data() + digits.size(), n).ec != std::errc()) n = ULONG_MAX;
+                if(n > 50)
+                    term << "Ignoring too large repeat count %s\n"_f % digits;
+                else
+                    repeat = { res[2], unsigned(n) };
                 continue;
             }
 
@@ -1474,14 +2460,8 @@ struct CommandReader
             }
 
             // Apply command aliases after dealing with the history
-            for(;;)
-            {
-                std::string orig_cmd = cmd;
-                for(const auto& r: aliases)
-                    cmd = std::regex_replace(cmd, r.pattern, r.replacement);
-                if(cmd == orig_cmd) break;
-            }
-            return cmd;
+            RewriteAliases(cmd);
+            return true;
         }
     }
     void PrintHistory()
@@ -1493,101 +2473,2823 @@ struct CommandReader
     }
 };
 
-int main()
+// Return the argument of a command without the spaces that precede it.
+// Returns an empty string if the argument was not separated by a space.
+static std::string Argument(const std::string& args)
 {
-    term << "`reset`Welcome to the treasure dungeon.\n\n";
+    auto p = args.find_first_not_of(' ');
+    return (p != 0 && p != args.npos) ? args.substr(p) : std::string();
+}
 
-    CommandReader cmd;
-help:
-    term <<
-        "`reset`Available commands:\n"
-        "\tl/look\n"
-        "\tla/look at <item>\n"
+// A game in progress: the player, their maze and their terminal.
+// Interactive games read their commands from std::cin and print to
+// std::cout. Others are driven with Command(), which returns everything
+// that the game printed in response. Games share no state with each
+// other, so any number of them can be played at once, each of them
+// by one thread at a time.
+struct Game
+{
+    // Player's location and life.
+    long x=0, y=0, life=1000;
+    bool pulling=false;
+    Eq eq;                      // Player's inventory
+    std::shared_ptr<Maze> world;    // Possibly shared with other players
+    Maze& maze = *world;
+    Term term;
+    std::mt19937 rnd;           // For everything but maze generation
+    CommandReader cmd{term};
+    std::smatch res;
+    Maze::Stats stats, last_turn;   // Rooms that this game looked up
+    bool over = false;
+    // How many rooms the map shows, with the player in the middle.
+    struct View
+    {
+        std::size_t width = 11, height = 9;
+    } view;
+    // In screen mode, the map and the information beside it stay at the
+    // top of the terminal. This is what was drawn there. See Draw().
+    struct Frame
+    {
+        bool                     on = false;
+        std::size_t              rows = 0;  // 0 if nothing is drawn yet
+        long                     x = 0, y = 0;
+        std::string              map;       // view.width * view.height
+        std::vector<std::string> info;
+    } frame;
+
+    // Commands are dispatched by their first word. Each handler receives
+    // the whole command and the text following the first word, and returns
+    // false if the rest of the command does not fit its syntax after all.
+    typedef std::function<bool(Game&, const std::string&, const std::string&)> Handler;
+    static const std::unordered_map<std::string, Handler>& Commands();
+    // Most commands do not accept any arguments.
+    static Handler Exact(std::function<void(Game&)> f);
+
+    explicit Game(bool interactive = true, std::shared_ptr<Maze> world = nullptr);
+    Game(const Game&) = delete;
+    void operator=(const Game&) = delete;
+
+    bool Run();
+    std::string Command(const std::string& line);
+    // Return the text that has been produced without a command
+    // (such as the introduction).
+    std::string Output() { return term.Output(); }
+    void End();
+
+    bool CanMoveTo(long wherex,long wherey, const Room& model = defaultroom);
+    Room& SpawnRooms(long wherex,long wherey, const Room& model = defaultroom);
+    void Look();
+    void Draw(std::string_view map, std::string_view info);
+    void Screen(bool on);
+    void EatLife(long l);
+    bool TryMoveBy(int xd,int yd);
+    void Move(int xd, int yd) { if(TryMoveBy(xd, yd)) Look(); }
+    void Nothing(const std::string& s) { term << "%s what?\n"_f % s; }
+    void Inv();
+    void LookAtIn(const Eq& where, const ItemReference& what,
+                  const std::string& here_str = "here");
+    void LookAt(const ItemReference& what, const ItemReference& where);
+    bool GetFrom(Eq& source, const ItemReference& what,
+                 const std::string& from_str = "",
+                 const std::string& here_str = "here");
+    void Get(const ItemReference& what, const ItemReference& where);
+    bool PutTo(Eq& target, const ItemReference& what,
+               const std::string& targetname = "");
+    void Put(const ItemReference& what, const ItemReference& where);
+    void Open(const ItemReference& what, const ItemReference& withwhat);
+    void Help();
+    bool Save(const std::string& filename);
+    bool Restore(const std::string& filename);
+};
+
+bool Game::CanMoveTo(long wherex,long wherey, const Room& model)
+{
+    if(!maze.Generate(wherex, wherey, model, 0).Wall[Chunk::Cell(wherex, wherey)]) return true;
+    return false;
+}
+
+Room& Game::SpawnRooms(long wherex,long wherey, const Room& model)
+{
+    Room& room = maze.GenerateRoom(wherex,wherey, model, 0);
+    #define Spawn4rooms(x,y) \
+        for(char p: { 1,3,5,7 }) \
+            maze.Generate(x + p%3-1, y + p/3-1, room, (p+1)/2)
+    // As far as the view reaches, and one room more to the sides.
+    const long dy = long(view.height/2), dx = long(view.width/2);
+    Spawn4rooms(wherex,wherey);
+    for(long o=1; o<=dy && CanMoveTo(wherex,wherey+o, room); ++o) Spawn4rooms(wherex,wherey+o);
+    for(long o=1; o<=dy && CanMoveTo(wherex,wherey-o, room); ++o) Spawn4rooms(wherex,wherey-o);
+    for(long o=1; o<=dx && CanMoveTo(wherex-o,wherey, room); ++o) Spawn4rooms(wherex-o,wherey);
+    for(long o=1; o<=dx && CanMoveTo(wherex+o,wherey, room); ++o) Spawn4rooms(wherex+o,wherey);
+    return room;
+}
+
+// The tag for the color of a character on the map.
+static const char* MapTag(char c)
+{
+    switch(c)
+    {
+        case '@': return "`me`";
+        case '#': return "`wall`";
+        case 'c': return "`chest`";
+        case 'r': return "`cart`";
+        case '.': return "`road`";
+        case 'i': return "`items`";
+        default:  return "";
+    }
+}
+
+// This routine is responsible for providing the view for the player.
+// It also generates new maze data.
+void Game::Look()
+{
+    // Generate rooms in the field of vision of the player.
+    const Room& room = SpawnRooms(x,y);
+
+    // Generate the current map view
+    const std::size_t width = view.width, height = view.height;
+    ScratchString map(width * height, ' ', &scratch.resource);
+    maze.Render(x - long(width/2), y - long(height/2), width, height, map.data());
+    map[height/2 * width + width/2] = '@';
+
+    // The contents of the room, which other players may be changing.
+    std::string items_str;
+    {
+        auto lock = maze.Lock(x,y);
+        items_str = room.items.print(false).first;
+    }
+
+    // This is the text that will be printed on the right side of the map
+    const std::string info_str =
+        "`reset`In a %s tunnel at %+3ld,%+3ld\n"_f % EnvTypes[room.Env].name % x % -y
+      + "`reset`Exits:`exit`%s%s%s%s\n\n"_f
+        % (CanMoveTo(x+0, y-1) ? " north" : "")
+        % (CanMoveTo(x+0, y+1) ? " south" : "")
+        % (CanMoveTo(x-1, y+0) ? " west" : "")
+        % (CanMoveTo(x+1, y+0) ? " east" : "")
+      + items_str;
+
+    if(frame.on) { Draw(map, info_str); return; }
+
+    // Print the map and the information side by side.
+    ScratchString screen(&scratch.resource);
+    std::string_view info = info_str;
+    for(std::size_t row = 0; row < height || !info.empty(); ++row)
+    {
+        screen += "`dfl`";
+        if(row < height)
+        {
+            screen += "`dfl`";
+            for(char c: std::string_view(map).substr(row * width, width)) { screen += MapTag(c); screen += c; }
+            screen += "`reset`";
+        }
+        else screen.append(width, ' ');
+        screen += " | `items`";
+        // The next line of information, if there is one.
+        auto end = std::min(info.find('\n'), info.size());
+        screen.append(info.substr(0, end)).append("\n");
+        info.remove_prefix(std::min(end+1, info.size()));
+    }
+    term << screen;
+}
+
+// In screen mode, the rows at the top of the terminal are kept for the
+// map and the information beside it, and everything else scrolls below
+// them. Only what differs from the previous frame is drawn, with the
+// cursor moved there and back. When the player has moved, what is on
+// the screen is moved first (if that is shorter than drawing it again).
+void Game::Draw(std::string_view map, std::string_view info)
+{
+    std::pmr::vector<std::string_view> lines(&scratch.resource);
+    while(!info.empty())
+    {
+        auto end = std::min(info.find('\n'), info.size());
+        lines.push_back(info.substr(0, end));
+        info.remove_prefix(std::min(end+1, info.size()));
+    }
+    ScratchString out(&scratch.resource);
+    auto Sequence = [&out](const char* format, std::size_t a, std::size_t b = 0)
+    {
+        char sequence[32];
+        out.append(sequence, std::snprintf(sequence, sizeof(sequence), format, a, b));
+    };
+    // Where the cursor is (1-based), or 0 if it is not known.
+    std::size_t at_row = 0, at_column = 0;
+    auto MoveTo = [&](std::size_t row, std::size_t column)
+    {
+        if(row != at_row || column != at_column) Sequence("\33[%zu;%zuH", row, column);
+        at_row = row; at_column = column;
+    };
+    const std::size_t height = view.height, width = view.width;
+    // A line of information that is not there at all, not even the " | ".
+    const std::string_view blank = "\n";
+
+    // When there are more lines than rows, start over with more rows.
+    std::size_t rows = std::max(height, lines.size());
+    bool full = rows > frame.rows;
+    auto color = std::make_pair(term.bold, term.color);
+    if(full)
+    {
+        // Restrict scrolling to the rows below, and clear the rows above.
+        Sequence("\33[%zu;r", rows + 2);
+        at_row = at_column = 1;
+        for(std::size_t row = 1; row <= rows + 1; ++row) { MoveTo(row, 1); out += "\33[K"; }
+        frame.rows = rows;
+        frame.map.assign(width * height, ' ');
+        frame.info.assign(rows, std::string(blank));
+    }
+    else
+        out += "\0337"; // Save the cursor (and the color)
+
+    long dx = x - frame.x, dy = y - frame.y;
+    if(!full && (dx || dy) && std::labs(dx) < long(width) && std::labs(dy) < long(height))
+    {
+        // What would be on the screen after moving it.
+        ScratchString moved(width * height, ' ', &scratch.resource);
+        std::size_t cells_still = 0, cells_moved = 0;
+        for(std::size_t row = 0; row < height; ++row)
+            for(std::size_t column = 0; column < width; ++column)
+            {
+                std::size_t r = row + dy, c = column + dx, cell = row * width + column;
+                if(r < height && c < width) moved[cell] = frame.map[r * width + c];
+                cells_still += map[cell] != frame.map[cell];
+                cells_moved += map[cell] != moved[cell];
+            }
+        // A cell takes about 8 bytes to draw, and moving takes some too.
+        if(cells_still * 8 > cells_moved * 8 + (dy ? 20 : 0) + (dx ? height * 20 : 0))
+        {
+            if(dy)
+            {
+                // Scroll the rows of the map, and the information beside them.
+                Sequence("\33[1;%zur", height);
+                Sequence(dy > 0 ? "\33[%zuS" : "\33[%zuT", std::labs(dy));
+                Sequence("\33[%zu;r", frame.rows + 2);
+                at_row = at_column = 1;
+                auto info = frame.info.begin();
+                if(dy > 0) std::fill(std::move(info + dy, info + height, info), info + height, blank);
+                else       std::fill(info, std::move_backward(info, info + height + dy, info + height), blank);
+            }
+            if(dx)
+                for(std::size_t row = 1; row <= height; ++row)
+                {
+                    // Delete characters on the left and insert as many
+                    // on the right of the map, or the other way around.
+                    MoveTo(row, dx > 0 ? 1 : width + 1 - std::labs(dx));
+                    Sequence("\33[%zuP", std::labs(dx));
+                    MoveTo(row, dx > 0 ? width + 1 - dx : 1);
+                    Sequence("\33[%zu@", std::labs(dx));
+                }
+            frame.map.assign(moved);
+        }
+    }
+    frame.x = x;
+    frame.y = y;
+
+    for(std::size_t row = 0; row < height; ++row)
+        for(std::size_t column = 0; column < width; ++column)
+        {
+            char c = map[row * width + column];
+            if(c == frame.map[row * width + column]) continue;
+            MoveTo(row + 1, column + 1);
+            out += MapTag(c); out += c;
+            ++at_column;
+            frame.map[row * width + column] = c;
+        }
+    for(std::size_t row = 0; row < frame.rows; ++row)
+    {
+        std::string_view line = row < lines.size() ? lines[row] : std::string_view();
+        if(line == frame.info[row]) continue;
+        if(frame.info[row] == blank) { MoveTo(row + 1, width + 1); out += "`reset` | "; }
+        else                           MoveTo(row + 1, width + 4);
+        out.append("`items`").append(line).append("\33[K");
+        at_row = at_column = 0;
+        frame.info[row] = line;
+    }
+
+    if(full) { MoveTo(rows + 2, 1); out += "\33[J"; }
+    else       out += "\0338"; // Restore the cursor
+    term << out;
+    if(!full) std::tie(term.bold, term.color) = color;
+}
+
+// Turn the screen mode on (drawing everything at the next look) or off.
+void Game::Screen(bool on)
+{
+    if(frame.on && !on)
+    {
+        // Let everything scroll again, and continue at the bottom.
+        term << "\33[r\33[999;1H\n";
+    }
+    frame.on   = on;
+    frame.rows = 0;
+}
+
+void Game::EatLife(long l)
+{
+    const char* msg = nullptr;
+    if(life>=800 && life-l<800) msg = "You are so hungry!\n";
+    if(life>=150 && life-l<150) msg = "You are famished!\n";
+    if(life>=70 && life-l<70) msg = "You are about to collapse any second!\n";
+    life -= l;
+    if(msg) { term << "`alert`%s`reset`"_f % msg; }
+}
+
+// Directions that the player can move to, and the step for each one.
+static const std::unordered_map<std::string, std::pair<int,int>> Directions =
+{
+    {"n", { 0,-1}}, {"north",     { 0,-1}},   {"s", { 0, 1}}, {"south",     { 0, 1}},
+    {"w", {-1, 0}}, {"west",      {-1, 0}},   {"e", { 1, 0}}, {"east",      { 1, 0}},
+    {"nw",{-1,-1}}, {"northwest", {-1,-1}},   {"ne",{ 1,-1}}, {"northeast", { 1,-1}},
+    {"sw",{-1, 1}}, {"southwest", {-1, 1}},   {"se",{ 1, 1}}, {"southeast", { 1, 1}}
+};
+
+bool Game::TryMoveBy(int xd,int yd)
+{
+    // If we are moving diagonally, ensure that there is an actual path.
+    if(!CanMoveTo(x+xd, y+yd) || (!CanMoveTo(x,y+yd) && !CanMoveTo(x+xd,y)))
+        { term << "You cannot go that way.\n"; return false; }
+
+    long burden = eq.burden();
+
+    if(pulling)
+    {
+        // The cart is taken from one room to the other at once.
+        auto locks = maze.Lock(x,y, x+xd,y+yd);
+        auto& room   = maze.GenerateRoom(x,y, defaultroom, 0);
+        auto& target = maze.GenerateRoom(x+xd, y+yd, defaultroom, 0);
+
+        const ItemReference what("all cart");
+
+        long cart_burden = 0;
+        for(long no=0; (no = room.items.find_item(what.refs.front(),no)) >= 0; )
+        {
+            cart_burden += (room.items.Items[no].cart->burden() + 10) / 5;
+
+            // Can't use room.items.move() here, because technically
+            // the cart is "immovable". Do the move manually.
+            target.items.push_front(room.items.Items[no]);
+            room.items.erase(no);
+            maze.Modify(x,y);
+            maze.Modify(x+xd, y+yd);
+
+            // Only pull the first cart.
+            // The "push_front" above ensures that when coming to
+            // a room with carts in it, you'll continue pulling the
+            // same cart instead of switching to another one.
+            break;
+        }
+
+        if(cart_burden)
+        {
+            //term << "Pulling that cart wears you down by %ld extra points.\n"_f % cart_burden;
+            burden += cart_burden;
+        }
+    }
+
+    x += xd;
+    y += yd;
+    EatLife(burden);
+    maze.Ahead(x,y, xd,yd);
+
+    return true;
+}
+
+void Game::Inv()
+{
+    auto p = eq.print(true);
+    if(!p.second) term << "You are carrying nothing.\n";
+    else          term << p.first << "\n";
+}
+
+void Game::LookAtIn(const Eq& where, const ItemReference& what,
+                    const std::string& here_str)
+{
+    // Look at items in the room.
+    for(const auto& w: what.refs)
+    {
+        std::pair<std::string,float> output;
+        auto AddItems = [&output](const std::pair<std::string,float>& src)
+        {
+            output.first  += src.first;
+            output.second += src.second;
+        };
+
+        for(long no=0; (no = where.find_item(w,no)) >= 0; )
+        {
+            AddItems(where.look_item(no++,what.IsSpecific()));
+            if(what.IsSpecific()) break;
+        }
+
+        // Look at money in the room, if there were no items or we're looking at everything.
+        if(what.everything || output.first.empty())
+            for(long no=0; (no = where.find_money(w,no)) >= 0; )
+            {
+                AddItems(where.look_money(no++,what.IsSpecific()));
+                if(what.IsSpecific()) break;
+            }
+
+        if(here_str == "here")
+        {
+            bool room_empty = output.first.empty();
+
+            // Look at inventory items, if there was nothing particular in the room.
+            if(output.first.empty())
+                for(long no=0; (no = eq.find_item(w,no)) >= 0; )
+                {
+                    AddItems(eq.look_item(no++,what.IsSpecific()));
+                    if(what.IsSpecific()) break;
+                }
+
+            // Look at inventory money, if...
+            if(output.first.empty() || (what.everything && room_empty))
+                for(long no=0; (no = eq.find_money(w,no)) >= 0; )
+                {
+                    AddItems(eq.look_money(no++,what.IsSpecific()));
+                    if(what.IsSpecific()) break;
+                }
+        }
+
+        if(!what.IsSpecific() && !output.first.empty())
+        {
+            if(output.second < 1.f)
+                output.first += "It is of no sales value at all.\n";
+            else
+                output.first += "You estimate that with them you could probably buy %s.\n"_f
+                                % Appraise(output.second, 1);
+        }
+
+        if(!output.first.empty())
+            term << output.first;
+        else
+            if(what.IsSpecific())
+                term << "There %s no %s %s that you can look at.\n"_f
+                        % (w.what.back()=='s' ? "are" : "is")
+                        % w.what
+                        % here_str;
+            else
+                term << "There is nothing %s.\n"_f % here_str;
+    }
+}
+
+void Game::LookAt(const ItemReference& what, const ItemReference& where)
+{
+    auto lock = maze.Lock(x,y);
+    const Room &room = maze.GenerateRoom(x,y, defaultroom, 0);
+
+    if(where.refs.empty())
+        LookAtIn(room.items, what);
+    else
+    {
+        unsigned n_sources = 0;
+        for(const auto& w: where.refs)
+        {
+            unsigned n = 0;
+            for(long no=0; (no = room.items.find_item(w,no)) >= 0; ++n)
+            {
+                const auto& container = room.items.Items[no++];
+                if(container.chest > 0.f)
+                {
+                    term << "You cannot see inside a closed chest!\n";
+                    continue;
+                }
+                if(!container.cart)
+                {
+                    term << UCfirst("%s does not contain anything!\n"_f
+                                    % AddArticle(container.name(1,1), true));
+                    continue;
+                }
+                LookAtIn(*container.cart, what,
+                         "in %s"_f % AddArticle(container.name(0,1), true));
+            }
+
+            if(!n && room.items.find_money(w,0) >= 0)
+            {
+                term << "You cannot look inside money! They do not contain anything.\n";
+                ++n;
+            }
+            if(!n && !where.everything)
+                term << "Look where? There is no %s in this room!\n"_f % w.what;
+            n_sources += n;
+        }
+        if(!n_sources && where.everything)
+            term << "There is nothing in this room!\n";
+    }
+}
+
+// Returns whether anything was taken.
+bool Game::GetFrom(Eq& source, const ItemReference& what,
+                   const std::string& from_str,
+                   const std::string& here_str)
+{
+    // Move stuff from room to the inventory.
+    auto moved = source.move(eq, what);
+
+    if(!moved.immovable.empty() && !what.everything)
+        term << UCfirst("%s could not be moved!\n"_f
+                        % ListWithCounts( std::move(moved.immovable) ));
+
+    if(!moved.notfound.empty())
+    {
+        if(moved.notfound.empty())
+            term << "There is nothing %s you can take!\n"_f % here_str;
+        else
+            term << "There is no %s %s!\n"_f
+                    % ListWithCounts( std::move(moved.notfound) ) % here_str;
+    }
+
+    if(!moved.moved.empty())
+    {
+        auto num = moved.moved.size();
+        std::string explanation = ListWithCounts( std::move(moved.moved) );
+        term << "You take %s%s.\n"_f % explanation % from_str;
+        // Eat two hitpoints for every item moved.
+        EatLife(num * 2);
+        return true;
+    }
+    term << "Nothing taken%s.\n"_f % from_str;
+    return false;
+}
+
+void Game::Get(const ItemReference& what, const ItemReference& where)
+{
+    auto lock = maze.Lock(x,y);
+    Room &room = maze.GenerateRoom(x,y, defaultroom, 0);
+    bool taken = false;
+
+    if(where.refs.empty())
+        taken = GetFrom(room.items, what);
+    else
+    {
+        unsigned n_sources = 0;
+        for(const auto& w: where.refs)
+        {
+            unsigned n = 0;
+            for(long no=0; (no = room.items.find_item(w,no)) >= 0; ++n)
+            {
+                auto& container = room.items.Items[no++];
+                if(container.chest > 0.f)
+                {
+                    term << "You cannot get anything from a closed chest.\n";
+                    continue;
+                }
+                if(!container.cart)
+                {
+                    term << "You cannot take things from %s.\n"_f
+                        % AddArticle(container.name(0,1), true);
+                    continue;
+                }
+                taken |= GetFrom(*container.cart, what,
+                                 " from %s"_f % AddArticle(container.name(0,1), true),
+                                 "in %s"_f % AddArticle(container.name(0,1), true) );
+            }
+            if(!n && !where.everything)
+                term << "Take from where? There is no %s in this room!\n"_f % w.what;
+            n_sources += n;
+        }
+        if(!n_sources && where.everything)
+            term << "There is nothing in this room!\n";
+    }
+    if(taken) maze.Modify(x,y);
+}
+
+// Returns whether anything was moved.
+bool Game::PutTo(Eq& target, const ItemReference& what,
+                 const std::string& targetname)
+{
+    // Move stuff from inventory to the specified destination.
+    auto moved = eq.move(target, what);
+
+    if(!moved.immovable.empty())
+        term << UCfirst("%s could not be moved!\n"_f
+                        % ListWithCounts( std::move(moved.immovable) ));
+
+    if(!moved.notfound.empty())
+    {
+        if(moved.notfound.empty())
+            term << "You don't have anything!\n";
+        else
+            term << "You don't have %s!\n"_f
+                    % ListWithCounts( std::move(moved.notfound) );
+    }
+
+    if(!moved.moved.empty())
+    {
+        auto num = moved.moved.size();
+        std::string explanation = ListWithCounts( std::move(moved.moved) );
+        if(targetname.empty())
+            term << "You drop %s.\n"_f % explanation;
+        else
+            term << "You put %s in %s.\n"_f % explanation % targetname;
+        // Eat half hitpoint for every item dropped.
+        EatLife(num / 2);
+        return true;
+    }
+    term << "Nothing moved.\n";
+    return false;
+}
+
+void Game::Put(const ItemReference& what, const ItemReference& where)
+{
+    auto lock = maze.Lock(x,y);
+    Room &room = maze.GenerateRoom(x,y, defaultroom, 0);
+
+    if(where.refs.empty())
+    {
+        if(PutTo(room.items, what)) maze.Modify(x,y);
+    }
+    else
+    {
+        if(!where.IsSpecific())
+        {
+            term << "Put where exactly? \"%s\" is rather vague.\n"_f % where.original;
+            return;
+        }
+
+        long container_no = room.items.find_item(where.refs.front());
+        if(container_no < 0)
+        {
+            term << "Put in where? There is no %s in this room!\n"_f % where.original;
+            return;
+        }
+        auto& container = room.items.Items[container_no];
+        if(container.chest > 0.f)
+        {
+            term << "You cannot put things in a closed chest.\n";
+            return;
+        }
+        if(!container.cart)
+        {
+            term << "You cannot put things in %s.\n"_f % AddArticle(container.name(0,1), true);
+            return;
+        }
+        if(PutTo(*container.cart, what, AddArticle(container.name(0,1), true))) maze.Modify(x,y);
+    }
+}
+
+void Game::Open(const ItemReference& what, const ItemReference& withwhat)
+{
+    auto lock = maze.Lock(x,y);
+    Room &room = maze.GenerateRoom(x,y, defaultroom, 0);
+
+    if(!what.IsSpecific())
+    {
+        term << "Open what exactly? \"%s\" is rather vague.\n"_f % what.original;
+        return;
+    }
+    if(!withwhat.refs.empty() && !withwhat.IsSpecific())
+    {
+        term << "Use what exactly? \"%s\" is rather vague.\n"_f % withwhat.original;
+        return;
+    }
+
+    long chest_no = room.items.find_item(what.refs.front());
+    if(chest_no < 0)
+    {
+        term << "There is no %s to open in this room!\n"_f % what.original;
+        return;
+    }
+    auto& open_item = room.items.Items[chest_no];
+    if(open_item.chest <= 0.f)
+    {
+        term << UCfirst("%s is not particularly in need of opening.\n"_f
+                        % AddArticle(open_item.name(1,1), true));
+        return;
+    }
+
+    // If the player tries to use an implement to open the chest,
+    // check whether they do in fact possess such a device.
+    long item_no = -1;
+
+    if(!withwhat.refs.empty())
+    {
+        item_no = eq.find_item(withwhat.refs.front());
+        if(item_no < 0)
+        {
+            term << "You don't have any %s!\n"_f % withwhat.original;
+            return;
+        }
+    }
+
+    rnd.seed( 71161183 * room.seed + item_no + open_item.chest * 0x8088401
+           + 971697*x + 5197161*y);
+
+    // Evaluate the implement!
+    // The heavier the material and the lighter the item, the more powerful it is.
+    //        e.g. "iron tie" and "gold sceptre" are pretty good,
+    //        and  "silk battlesuit" does not help at all.
+    //   Our own power is equivalent to about "leather sceptre".
+    // The heavier and less costly it is, the less damage it tends to take.
+    //        e.g. "iron hammer" does not take much damage,
+    //        but  "silk cap" is damaged beyond repair at once.
+    //   This is not a perfect measure, for instance glass is more formidable as leather...
+    //   We are about as formidable as "good leather dagger".
+    // The heavier it is, the more effort it takes to use it.
+    float prying_power      = 0.5 / 2.5;                    // 0.2
+    float damage_resistance = (0.5 * 1.5) / (0.9*0.09*0.1); // 92.593
+    long  effort_cost       = 8;
+
+    if(item_no >= 0)
+    {
+        const auto& item = eq.Items[item_no];
+        prying_power      = BuildTypes[item.build].weight / ItemTypes[item.type].weight;
+        damage_resistance = item.weight() / item.value(1.f);
+        effort_cost       = item.weight();
+    }
+
+    term << "You try to pry %s open %s.\n"_f
+        % AddArticle(open_item.name(0,0), true)
+        % (item_no < 0 ? "with your bare hands"
+                       : ("using your " + eq.Items[item_no].name(1,1)));
+
+    EatLife(effort_cost);
+
+    maze.Modify(x,y);
+    room.items.modify(chest_no, [&](ItemType& item)
+        { item.chest -= prying_power * (0.5f + 5.f*std::pow(frand(),4.f)); });
+
+    if(frand() > 0.75f && frand() > damage_resistance/500.f)
+    {
+        // If we are using an implement, the damage may
+        // be transferred into the item instead!
+        bool item_damaged = (item_no >= 0 && frand() >= 0.25f);
+        if(item_damaged)
+        {
+            std::string name = eq.Items[item_no].name(1,1);
+            if(eq.Items[item_no].condition+1u >= count(CondTypes))
+            {
+                term << "`alert`Your %s gets damaged! It is utterly destroyed.\n"_f % name;
+                eq.erase( item_no );
+            }
+            else
+            {
+                eq.modify(item_no, [](ItemType& item) { ++item.condition; });
+                term << "`alert`Your %s gets damaged! It is now in %s condition.\n"_f
+                    % name
+                    % eq.Items[item_no].GetCondition();
+            }
+        }
+        else
+        {
+            unsigned sprain = rand(count(BodyParts));
+            EatLife(BodyParts[sprain].worth);
+            term << "You sprain your %s!\n"_f % BodyParts[sprain].name;
+        }
+    }
+
+    term << "`reset`";
+
+    // Did the chest open?
+    if(open_item.chest > 0.f)
+    {
+        term << UCfirst("%s resists your meddling! Try harder.\n"_f
+                        % AddArticle(open_item.name(0,0), true));
+        if(item_no < 0 && frand() < 0.3)
+            term << "Try using a tool: 'open chest using <item>'.\n";
+        return;
+    }
+
+    // Restore the strength, to make sure the name is properly printed the last time.
+    room.items.modify(chest_no, [](ItemType& item) { item.chest = 1.0f; });
+    term
+        << UCfirst("%s bursts into pieces!\n"_f % AddArticle(open_item.name(0,0), true))
+        << "Everything it contained is scattered on the ground.\n";
+
+    // Delete the chest from the room.
+    room.items.erase( chest_no );
+
+    // Generate the contents of the box. There is at least one item inside.
+    do
+        if(frand() > 0.96) // pure money is rare.
+        {
+            unsigned moneytype((1.0-std::pow(frand(), 4)) * (count(MoneyTypes)-1));
+            room.items.Money[moneytype] += rand(1600/MoneyTypes[moneytype].worth);
+        }
+        else
+            room.items.push_front(ItemType(rnd));
+    while(frand() > 0.3);
+}
+
+void Game::Help()
+{
+    term <<
+        "`reset`Available commands:\n"
+        "\tl/look\n"
+        "\tla/look at <item>\n"
         "\tn/s/w/e for moving\n"
         "\tget <item>/get all/ga for short\n"
         "\tdrop <item>/drop all\n"
         "\ti/inv/inventory\n"
         "\tansi off, if the colors don't work for you\n"
+        "\tscreen on, to keep the map in place (screen off to undo)\n"
+        "\tview <width>x<height>, to see more (or less) of the maze\n"
+        "\tstats, to see how many rooms were looked up and generated\n"
+     << (cmd.interactive ? "\tsave/restore [<file>]\n" : "") <<
         "\tquit\n"
         "\thelp\n\n"
         "You are starving. You are trying to find enough stuff to sell\n"
         "for food before you die. Beware, food is very expensive here.\n\n";
+}
+
+// Start a new game, in a maze of its own unless one is given.
+Game::Game(bool interactive, std::shared_ptr<Maze> world)
+    : world(world ? std::move(world) : std::make_shared<Maze>())
+{
+    term.buffered = !interactive;
+    cmd.interactive = interactive;
+
+    term << "`reset`Welcome to the treasure dungeon.\n\n";
+    Help();
+    Look();
+}
+
+Game::Handler Game::Exact(std::function<void(Game&)> f)
+{
+    return [f](Game& g, const std::string&, const std::string& args)
+    {
+        if(!args.empty()) return false;
+        f(g);
+        return true;
+    };
+}
+
+// The commands are the same in every game.
+const std::unordered_map<std::string, Game::Handler>& Game::Commands()
+{
+    static const auto commands = []
+    {
+        std::unordered_map<std::string, Handler> commands =
+        {
+            // First, some metacommands
+            { "!?",      Exact([](Game& g){ g.cmd.PrintHistory(); }) },
+            { "history", Exact([](Game& g){ g.cmd.PrintHistory(); }) },
+            { "help",    Exact([](Game& g){ g.Help(); g.Look(); }) },
+            { "what",    Exact([](Game& g){ g.Help(); g.Look(); }) },
+            { "?",       Exact([](Game& g){ g.Help(); g.Look(); }) },
+
+            // Some fundamental movement commands, optionally preceded by a verb
+            { "go",   [](Game& g, const std::string&, const std::string& args)
+                      {
+                          auto i = Directions.find(Argument(args));
+                          if(i == Directions.end()) return false;
+                          g.Move(i->second.first, i->second.second);
+                          return true;
+                      } },
+
+            // Then commands for looking at things.
+            // Use the power of regex to recognize complex syntax.
+            { "look", [](Game& g, const std::string& s, const std::string& args)
+                      {
+                          if(args.empty() || Argument(args) == "around") g.Look();
+                          else if(std::regex_match(s, g.res, "look(?: +at)? +(.*?)(?: +in +(.+))?"_r))
+                              g.LookAt(g.res[1].str(), g.res[2].str());
+                          else return false;
+                          return true;
+                      } },
+
+            // A command for opening chests, possibly with some implements
+            { "open", [](Game& g, const std::string& s, const std::string& args)
+                      {
+                          if(args.empty()) g.Nothing(s);
+                          else if(std::regex_match(s, g.res, "open +(.+?)(?: +with +(.+))?"_r))
+                              g.Open(g.res[1].str(), g.res[2].str());
+                          else return false;
+                          return true;
+                      } },
+
+            // Inventory manipulation commands
+            { "inv",  Exact(&Game::Inv) },
+            { "get",  [](Game& g, const std::string& s, const std::string& args)
+                      {
+                          if(args.empty()) g.Nothing(s);
+                          else if(std::regex_match(s, g.res, "get +(.+?)(?: +from +(.+))?"_r))
+                              g.Get(g.res[1].str(), g.res[2].str());
+                          else return false;
+                          return true;
+                      } },
+            { "drop", [](Game& g, const std::string& s, const std::string& args)
+                      {
+                          if(args.empty()) g.Nothing(s);
+                          else if(std::regex_match(s, g.res, "drop +(.+?)(?: +(?:to|in) +(.+))?"_r))
+                              g.Put(g.res[1].str(), g.res[2].str());
+                          else return false;
+                          return true;
+                      } },
+
+            { "ansi", [](Game& g, const std::string&, const std::string& args)
+                      {
+                          auto state = Argument(args);
+                          if(state != "on" && state != "off") return false;
+                          if(state == "off") g.Screen(false);
+                          g.term.EnableDisable(state == "on");
+                          return true;
+                      } },
+            { "screen", [](Game& g, const std::string&, const std::string& args)
+                      {
+                          auto state = Argument(args);
+                          if(state != "on" && state != "off") return false;
+                          if(state == "on" && !g.term.enabled)
+                              g.term << "The screen mode needs ansi on.\n";
+                          else
+                          {
+                              g.Screen(state == "on");
+                              g.Look();
+                          }
+                          return true;
+                      } },
+            { "view",   [](Game& g, const std::string& s, const std::string&)
+                      {
+                          if(!std::regex_match(s, g.res, "view +([0-9]{1,3}) *x *([0-9]{1,3})"_r)) return false;
+                          std::size_t width = std::stoul(g.res[1]), height = std::stoul(g.res[2]);
+                          if(width % 2 == 0 || height % 2 == 0 || width > 201 || height > 101)
+                              g.term << "The view is from 1x1 to 201x101 rooms, odd sizes only.\n";
+                          else
+                          {
+                              g.view = { width, height };
+                              g.frame.rows = 0;
+                              g.Look();
+                          }
+                          return true;
+                      } },
+            // These accept anything after the first word.
+            { "wear", [](Game& g, const std::string&, const std::string&)
+                      {
+                          g.term << "You are scavenging for survival and not playing an RPG character.\n";
+                          return true;
+                      } },
+            { "eat",  [](Game& g, const std::string&, const std::string&)
+                      {
+                          g.term << "You have nothing edible! You are hoping to collect something you can sell for food.\n";
+                          return true;
+                      } },
+            { "pull", [](Game& g, const std::string&, const std::string&)
+                      {
+                          g.term << "Ok, you will pull any cart with you when you move. Type 'stop' to stop pulling.\n";
+                          g.pulling = true;
+                          return true;
+                      } },
+            { "stop", Exact([](Game& g){ g.term << "Ok, you will leave carts alone.\n"; g.pulling = false; }) },
+
+            // Saving and restoring the game, only at the player's own terminal.
+            { "save",    [](Game& g, const std::string&, const std::string& args)
+                         {
+                             if(!g.cmd.interactive) return false;
+                             std::string file = Argument(args); if(file.empty()) file = "dungeon.sav";
+                             if(g.Save(file)) g.term << "Saved the game in %s.\n"_f % file;
+                             else             g.term << "Could not save the game in %s.\n"_f % file;
+                             return true;
+                         } },
+            { "restore", [](Game& g, const std::string&, const std::string& args)
+                         {
+                             if(!g.cmd.interactive) return false;
+                             std::string file = Argument(args); if(file.empty()) file = "dungeon.sav";
+                             if(g.Restore(file)) g.Look();
+                             else g.term << "There is no game saved in %s.\n"_f % file;
+                             return true;
+                         } },
+
+            // How much maze generation the previous command took.
+            { "stats", Exact([](Game& g){
+                          g.term << "Rooms looked up: %lu found, %lu generated (previous command: %lu found, %lu generated)\n"_f
+                                    % g.stats.hits % g.stats.misses % g.last_turn.hits % g.last_turn.misses;
+                      }) }
+        };
+        commands["walk"]  = commands["move"] = commands["go"];
+        commands["wield"] = commands["eq"]   = commands["wear"];
+        for(const auto& d: Directions)
+            commands[d.first] = Exact([=](Game& g){ g.Move(d.second.first, d.second.second); });
+        return commands;
+    }();
+    return commands;
+}
+
+// Save the state of the player and the maze, except what the maze can
+// generate again: the contents of rooms that nobody has changed. Only
+// for games that have a maze of their own.
+bool Game::Save(const std::string& filename)
+{
+    if(maze.shared) return false;
+    std::string out(Snapshot::Magic, sizeof(Snapshot::Magic));
+    Pack<std::uint32_t>(out, Snapshot::Version);
+    Pack<std::int64_t>(out, x); Pack<std::int64_t>(out, y); Pack<std::int64_t>(out, life);
+    Pack<std::uint8_t>(out, pulling);
+    PackItems(out, eq);
+    maze.Save(out);
+
+    // The old file may still be in use (see Snapshot), so write
+    // a new one and put it in its place.
+    std::string temp = filename + ".new";
+    std::FILE* file = std::fopen(temp.c_str(), "wb");
+    if(!file) return false;
+    bool ok = std::fwrite(out.data(), 1, out.size(), file) == out.size();
+    if(std::fclose(file) != 0) ok = false;
+    if(!ok || std::rename(temp.c_str(), filename.c_str()) != 0) { std::remove(temp.c_str()); return false; }
+    return true;
+}
+
+// Restore a saved game in place of this one. The rooms are read from
+// the file when they are needed.
+bool Game::Restore(const std::string& filename)
+{
+    if(maze.shared) return false;
+    std::unique_ptr<Snapshot> snapshot(new Snapshot);
+    const char* p = snapshot->Open(filename);
+    if(!p) return false;
+    Unpacker in(p, snapshot->data + snapshot->size);
+    long nx = in.Get<std::int64_t>(), ny = in.Get<std::int64_t>(), nlife = in.Get<std::int64_t>();
+    bool npulling = in.Get<std::uint8_t>();
+    Eq neq;
+    if(!UnpackItems(in, neq) || !snapshot->OpenIndex(in.p)) return false;
+
+    x = nx; y = ny; life = nlife; pulling = npulling;
+    eq = std::move(neq);
+    maze.Clear();
+    maze.snapshot = std::move(snapshot);
+    return true;
+}
+
+// Run the commands given so far. Returns true if the game goes on,
+// and false if it is over. Interactive games run until they are over.
+bool Game::Run()
+{
+    const auto& commands = Commands();
+    Maze::Counting counting(stats);
+    while(!over && life > 0)
+    {
+        cmd.SetPrompt( "[life:%ld]> "_f % life );
+
+        // Produce the prompt and wait for player's command.
+        std::string s;
+        if(!cmd.ReadCommand(s)) return true;
+        if(s == "quit") break;
+        if(s.empty()) continue;
+
+        // The first word is a run of letters and digits, or the entire
+        // command, if it begins with something else (such as "?").
+        auto verb_end = std::find_if_not(s.begin(), s.end(),
+                            [](unsigned char c) { return std::isalnum(c) || c == '_'; });
+        if(verb_end == s.begin()) verb_end = s.end();
+
+        auto before = stats;
+        auto i = commands.find( std::string(s.begin(), verb_end) );
+        if(i == commands.end() || !i->second(*this, s, std::string(verb_end, s.end())))
+        {
+            // Any unrecognized command.
+            term << "what?\n";
+        }
+        last_turn = stats - before;
+        maze.Trim();
+        scratch.resource.release();
+    }
+    if(!over) End();
+    return false;
+}
+
+// Give one line of input to a game that is not interactive,
+// and return the text that it produced.
+std::string Game::Command(const std::string& line)
+{
+    cmd.Feed(line);
+    Run();
+    return term.Output();
+}
+
+void Game::End()
+{
+    over = true;
+    Screen(false);
+
+    // By mercy, get all from cart.
+    if(pulling) Get("all", "all cart");
+
+    float value = eq.printed_value();
+
+    term
+        << "`alert`%s\n"_f % (life<0
+            ? "You are pulled out from the maze by a supernatural force!"
+            : "byebye")
+        << "[life:%ld] Game over\n`reset`"_f % life
+        << "You managed to collect stuff worth %.2f gold.\n"_f % value
+        << "With all your possessions, you purchase %s.\n"
+           "You consume your reward eagerly.\n"_f % Appraise(value)
+        << "YOU %s\n"_f
+        % (value<10000.0
+            ? "DID NOT SURVIVE. Hint: Learn to judge the value/weight ratio."
+            : "SURVIVED! CONGRATULATION. ;)");
+}
+
+#ifdef __linux__
+// Serving games over a socket, to any number of players at once.
+// Each worker thread runs an epoll loop of its own, and accepts
+// connections from the shared listening socket, which EPOLLEXCLUSIVE
+// hands to one waiting worker at a time. A connection stays with the
+// worker that accepted it, so each game is only ever touched by one
+// thread, and the workers share no locks.
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+// Make a socket address: a TCP port of the loopback interface,
+// or a Unix domain socket if the address contains a slash.
+static int SocketAddress(const std::string& address, sockaddr_storage& a, socklen_t& length)
+{
+    a = sockaddr_storage{};
+    if(address.find('/') != address.npos)
+    {
+        auto& u = reinterpret_cast<sockaddr_un&>(a);
+        if(address.size() >= sizeof(u.sun_path)) return -1;
+        u.sun_family = AF_UNIX;
+        address.copy(u.sun_path, address.size());
+        length = sizeof(u);
+        return AF_UNIX;
+    }
+    auto& i = reinterpret_cast<sockaddr_in&>(a);
+    i.sin_family      = AF_INET;
+    i.sin_port        = htons(std::uint16_t(std::atoi(address.c_str())));
+    i.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    length = sizeof(i);
+    return AF_INET;
+}
+
+// Allow as many open sockets as the system lets us have.
+static void RaiseFileLimit()
+{
+    rlimit r;
+    if(getrlimit(RLIMIT_NOFILE, &r) == 0) { r.rlim_cur = r.rlim_max; setrlimit(RLIMIT_NOFILE, &r); }
+}
+
+struct Server
+{
+    struct Connection
+    {
+        int fd;
+        Game game;
+        std::string input, output;
+        bool writing = false, closing = false;
+
+        Connection(int fd, const std::shared_ptr<Maze>& world) : fd(fd), game(false, world) {}
+    };
+    int listener = -1;
+    std::shared_ptr<Maze> world;    // If everybody plays in the same maze
+
+    bool Listen(const std::string& address)
+    {
+        sockaddr_storage a; socklen_t length = 0;
+        int family = SocketAddress(address, a, length); if(family < 0) return false;
+        if(family == AF_UNIX) unlink(address.c_str());
+        listener = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if(listener < 0) return false;
+        int one = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        return bind(listener, reinterpret_cast<sockaddr*>(&a), length) == 0
+            && listen(listener, SOMAXCONN) == 0;
+    }
+
+    void Work()
+    {
+        int ep = epoll_create1(EPOLL_CLOEXEC);
+        epoll_event ev{};
+        ev.events   = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = nullptr;          // Means the listening socket
+        epoll_ctl(ep, EPOLL_CTL_ADD, listener, &ev);
+
+        std::unordered_map<Connection*, std::unique_ptr<Connection>> connections;
+        epoll_event events[64];
+        for(;;)
+        {
+            int n = epoll_wait(ep, events, count(events), -1);
+            for(int e=0; e<n; ++e)
+            {
+                auto* c = static_cast<Connection*>(events[e].data.ptr);
+                if(!c)
+                {
+                    // Take one connection at a time, so that they are
+                    // spread evenly among the workers.
+                    int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                    if(fd < 0) continue;
+                    c = new Connection(fd, world);
+                    connections.emplace(c, std::unique_ptr<Connection>(c));
+                    // The workers keep the cores busy already.
+                    if(!world) c->game.maze.pregenerated.reset();
+                    ev.events   = EPOLLIN;
+                    ev.data.ptr = c;
+                    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+                    // A game that fails ends only its own connection,
+                    // not the others served by this worker.
+                    try { c->game.Run(); }  // Up to the first prompt
+                    catch(const std::exception&) { c->closing = true; }
+                    c->output = c->game.Output();
+                }
+                else if(events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                {
+                    try { Read(*c); }
+                    catch(const std::exception&) { c->closing = true; }
+                }
+                if(!Write(ep, *c)) { close(c->fd); connections.erase(c); }
+            }
+        }
+    }
+
+    // Run the commands that have arrived.
+    void Read(Connection& c)
+    {
+        char buffer[4096];
+        ssize_t r = read(c.fd, buffer, sizeof(buffer));
+        if(r < 0 && errno == EAGAIN) return;
+        // If the player is gone, there is nobody to tell anything to.
+        if(r <= 0) { c.closing = true; c.output.clear(); return; }
+        c.input.append(buffer, r);
+
+        std::size_t begin = 0;
+        for(std::size_t end; !c.closing && (end = c.input.find('\n', begin)) != c.input.npos; begin = end+1)
+        {
+            std::size_t length = end - begin;
+            if(length && c.input[end-1] == '\r') --length;
+            c.output += c.game.Command(c.input.substr(begin, length));
+            if(c.game.over) c.closing = true;
+        }
+        c.input.erase(0, begin);
+        if(c.input.size() > sizeof(buffer)) c.closing = true; // Nobody types that much
+    }
+
+    // Send what can be sent. Returns false when the connection is done.
+    bool Write(int ep, Connection& c)
+    {
+        while(!c.output.empty())
+        {
+            ssize_t w = send(c.fd, c.output.data(), c.output.size(), MSG_NOSIGNAL);
+            if(w < 0 && errno == EAGAIN) break;
+            if(w < 0) return false;
+            c.output.erase(0, w);
+        }
+        if(c.output.empty() && c.closing) return false;
+        // Wait for room to send more, but only while there is more.
+        bool writing = !c.output.empty();
+        if(writing != c.writing)
+        {
+            epoll_event ev{};
+            ev.events   = writing ? EPOLLIN | EPOLLOUT : EPOLLIN;
+            ev.data.ptr = &c;
+            epoll_ctl(ep, EPOLL_CTL_MOD, c.fd, &ev);
+            c.writing = writing;
+        }
+        return true;
+    }
+};
+
+#endif
+
+#ifdef DUNGEON_BENCH
+// A benchmark of the game engine, built instead of the game with
+//     g++ -std=c++17 -O2 -pthread -DDUNGEON_BENCH dungeon.cc -o dungeon_bench
+// It replays the files of recorded commands (one per line) that it is
+// given, or without arguments, streams of randomly chosen commands.
+// With "--load <address> <idle> <active> [seconds]", it plays against
+// a server started with "dungeon --listen <address>" instead, and with
+// "--shared <players> <threads> crowd|spread [seconds]", it has many
+// players share one maze. With "--paging <budget> [commands]", one
+// player goes far with a limited number of chunks in memory, and then
+// rooms are changed over and over while their chunks are put away,
+// "--snapshot [file]" saves and restores ever larger games,
+// "--screen [commands]" counts the bytes sent in the screen mode, and
+// "--view [<width> <height>]" times rendering a large map.
+// "--parse [references]" checks the item reference parser against the
+// regular expressions that it replaced, "--aliases [file]" does the
+// same for the aliases, and times reading the commands,
+// "--counts [names]" times listing many items of a few kinds,
+// "--items [n]" times putting down, carrying and moving many items
+// (built with -DNDEBUG, or the totals are counted again on every step),
+// "--appraise" checks and times what the player's wealth buys,
+// "--money" checks and times the names that money goes by,
+// "--rooms" checks that the maze generator makes the mazes it did,
+// "--inflect" checks and times the English word functions, "--regex"
+// times their old versions with and without compiling every pattern
+// again, and "--move" checks and times moving items.
+#include <chrono>
+#include <fstream>
+#include <new>
+
+// Count the memory allocations made by the game (but not its workers).
+static thread_local unsigned long allocations = 0;
+[[gnu::noinline]] void* operator new(std::size_t n)
+{
+    ++allocations;
+    if(void* p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+[[gnu::noinline]] void operator delete(void* p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+static std::vector<std::string> RandomCommands(unsigned seed, std::size_t n)
+{
+    static const char* const vocabulary[] =
+        { "n","s","e","w","ne","nw","se","sw", "n","s","e","w","n","s","e","w",
+          "l","ga","i","da","la all","la shirt","get shirt","drop shoe",
+          "open chest","open chest with all","pry chest using dagger",
+          "look in cart","get all from cart","put all in cart","pull","stop",
+          "3 n","!look","history","xyzzy" };
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<std::size_t> pick(0, count(vocabulary)-1);
+    std::vector<std::string> result;
+    while(result.size() < n) result.push_back(vocabulary[pick(gen)]);
+    return result;
+}
+
+// Play the commands, starting a new game whenever one ends.
+static void Bench(const std::string& name, const std::vector<std::string>& commands)
+{
+    std::vector<double> latency;
+    unsigned long allocs = 0;
+    double total = 0;
+    std::unique_ptr<Game> game;
+    for(const auto& c: commands)
+    {
+        if(!game || game->over)
+        {
+            game.reset();
+            game.reset(new Game(false));
+            game->Output();
+        }
+        unsigned long before = allocations;
+        auto start = std::chrono::steady_clock::now();
+        game->Command(c);
+        latency.push_back( std::chrono::duration<double,std::micro>(std::chrono::steady_clock::now() - start).count() );
+        allocs += allocations - before;
+        total += latency.back();
+    }
+    if(latency.empty()) return;
+    std::sort(latency.begin(), latency.end());
+    std::string report =
+        "%-24s %7lu commands %9.0f commands/s  p50 %7.1f us  p99 %7.1f us  %7.1f allocations/command\n"_f
+        % name % latency.size() % (latency.size() / total * 1e6)
+        % latency[latency.size() / 2] % latency[latency.size() * 99 / 100]
+        % (double(allocs) / latency.size());
+    std::cout << report;
+}
+
+// Have many players play in one maze, on several threads at once. In
+// a crowd, nobody leaves the room where they all start, so that they
+// keep fighting over the same things. Otherwise they spread out.
+static int Shared(unsigned players, unsigned threads, bool crowd, double seconds)
+{
+    auto world = std::make_shared<Maze>(true);
+    std::atomic<unsigned long> done{0};
+    auto end = std::chrono::steady_clock::now()
+             + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+    std::vector<std::thread> workers;
+    for(unsigned t=0; t<threads; ++t)
+        workers.emplace_back([&,t]
+        {
+            std::vector<std::unique_ptr<Game>> games;
+            for(unsigned p=t; p<players; p+=threads) games.emplace_back(new Game(false, world));
+            auto commands = RandomCommands(t+1, 4096);
+            unsigned long n = 0, next = 0;
+            while(std::chrono::steady_clock::now() < end)
+                for(auto& g: games)
+                {
+                    const auto& c = commands[next++ % commands.size()];
+                    if(crowd && (Directions.count(c) || std::isdigit(c[0]))) continue;
+                    if(g->over) g.reset(new Game(false, world));
+                    g->Command(c);
+                    ++n;
+                }
+            done += n;
+        });
+    for(auto& w: workers) w.join();
+    // However the threads raced, each chunk must have been added once.
+    std::size_t chunks = 0, twice = 0;
+    for(std::size_t b=0; b<=world->chunks.mask; ++b)
+    {
+        std::unordered_set<std::uint64_t> keys;
+        for(auto* n = world->chunks.buckets[b].load(); n; n = n->next, ++chunks)
+            if(!keys.insert(n->key).second) ++twice;
+    }
+    // What was drawn ahead is let go of once it is used.
+    std::size_t ready, requested;
+    {
+        std::lock_guard<std::mutex> l(world->pregenerated->lock);
+        ready     = world->pregenerated->ready.size();
+        requested = world->pregenerated->requested.size();
+    }
+    std::string report = "%u players on %u threads in a %s: %9.0f commands/s, %zu chunks, %zu twice, %zu/%zu drawn/asked for\n"_f
+                         % players % threads % (crowd ? "crowd" : "spread") % (done / seconds) % chunks % twice
+                         % ready % requested;
+    std::cout << report;
+    return twice != 0;
+}
+
+// The item reference parser as it was written with regular expressions,
+// to check the one that ItemReference has now against.
+struct RegexItemReference
+{
+    typedef ItemReference::SingleReference SingleReference;
+    bool everything = false;
+    std::string original;
+    std::deque<SingleReference> refs, except;
+
+    RegexItemReference(const std::string& what)
+    {
+        std::smatch res;
+        std::regex_match(what, res, "(.*?)(?: except (.+))?"_r);
+        original = res[1];
+        if(original == "all" || original == "everything")
+        {
+            everything = true;
+            SingleReference w;
+            w.index = 0;
+            refs.push_back(w);
+        }
+        else if(!original.empty())
+            ParseReferences(refs, original);
+        if(res[2].length()) ParseReferences(except, res[2]);
+    }
+    void ParseReferences(std::deque<SingleReference>& list, const std::string& what)
+    {
+        const auto& pat = " *((?:(?! *,| and | *$).)+)(?:[ ,]|and )*"_r;
+        std::smatch res;
+        for(auto b = what.begin(); std::regex_search(b, what.end(), res, pat); b = res[0].second)
+            list.push_back( ParseSingleReference( res[1] ) );
+    }
+    SingleReference ParseSingleReference(const std::string& part) const
+    {
+        SingleReference w;
+        std::string word = part;
+        for(unsigned a=1; a<=12; ++a)
+            word = std::regex_replace(word,
+                Regex( (R"(^%s\b)"_f % Numerals1to12[a-1]).str() ),
+                ("%u"_f % a).str());
+        static std::regex pattern("^((all|[0-9]+) +)? *(.*)");
+        std::smatch res;
+        std::regex_match(word, res, pattern);
+        w.what                 = res[3];
+        std::string number_str = res[2];
+        if(number_str == "all")
+            w.index = 0;
+        else if(!number_str.empty())
+            w.amount = std::stol(number_str);
+        else
+        {
+            static std::regex pattern("^(.*?)(?: +([0-9]+))?$");
+            std::smatch res;
+            std::regex_match(w.what, res, pattern);
+            w.what             = res[1];
+            number_str         = res[2];
+            if(!number_str.empty())
+                w.index = std::stol(number_str);
+        }
+        return w;
+    }
+};
+
+// Parse random item references with both parsers, and compare them.
+// References with numbers too large for a long are left out, because
+// the regular expressions throw on them.
+static int Parse(std::size_t n)
+{
+    static const char* const words[] =
+        { "shirt","shirts","gold","coins","coin","a","the","an","awesome","crown","iron cap",
+          "one","two","twelve","eleven","oneself","ten-","all","everything","and","except",
+          "0","1","2","12","007","99999999999999999999","x","_","-","s" };
+    static const char* const separators[] =
+        { " "," "," "," ","  ",", ",",",", and "," and "," and and ","and ",
+          " except "," except","  except  ",""," , ","\t","\r","\n" };
+    std::mt19937 gen(1);
+    std::vector<std::string> corpus;
+    while(corpus.size() < n)
+    {
+        std::string r;
+        for(unsigned k = gen() % 8; k-- > 0; )
+        {
+            if(gen() % 2) r += words[gen() % count(words)];
+            else if(gen() % 4) r += separators[gen() % count(separators)];
+            else r.push_back(separators[gen() % count(separators)][0]);
+        }
+        corpus.push_back(r);
+    }
+    corpus.push_back(std::string("two\0 shirts", 12));
+
+    auto Same = [](const auto& a, const auto& b)
+    {
+        return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const auto& x, const auto& y)
+            { return x.what == y.what && x.amount == y.amount && x.index == y.index; });
+    };
+    std::size_t checked = 0, differ = 0;
+    for(const auto& c: corpus)
+        try
+        {
+            ItemReference mine(c);
+            RegexItemReference theirs(c);
+            ++checked;
+            if(mine.everything == theirs.everything && mine.original == theirs.original
+            && Same(mine.refs, theirs.refs) && Same(mine.except, theirs.except)) continue;
+            if(++differ <= 10) std::cout << "Differs: \"" << c << "\"\n";
+        }
+        catch(const std::out_of_range&) {}
+    auto Time = [&](const char* what, auto parse)
+    {
+        unsigned long before = allocations;
+        auto start = std::chrono::steady_clock::now();
+        for(const auto& c: corpus) parse(c);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::string report = "%-6s %7zu references: %8.3f us/reference %7.2f allocations/reference\n"_f
+                             % what % corpus.size() % (elapsed * 1e6 / corpus.size())
+                             % (double(allocations - before) / corpus.size());
+        std::cout << report;
+    };
+    Time("regex",  [](const std::string& c) { try { RegexItemReference r(c); } catch(const std::out_of_range&) {} });
+    Time("parser", [](const std::string& c) { ItemReference r(c); });
+    std::string report = "%zu of %zu references checked, %zu differ\n"_f % checked % corpus.size() % differ;
+    std::cout << report;
+    return differ != 0;
+}
+
+// The aliases as they were applied with regular expressions, over and
+// over until nothing changed.
+static void RegexAliases(std::string& cmd)
+{
+    static const std::pair<std::regex, std::string> substitutions[] =
+    {
+        { R"(^l\b)"_r,                     "look"     },
+        { R"(^lat? )"_r,                   "look at " },
+        { R"(^lin? )"_r,                   "look in " },
+        { R"(^look in )"_r,                "look at all in " },
+        { R"(^ga\b)"_r,                    "get all"  },
+        { R"(^da\b)"_r,                    "drop all" },
+        { R"(^d )"_r,                      "drop "    },
+        { R"(^g )"_r,                      "get "     },
+        { R"(^take )"_r,                   "get "     },
+        { R"(^pry )"_r,                    "open "    },
+        { R"(^i\b)"_r,                     "inv"      },
+        { R"(^inventory\b)"_r,             "inv"      },
+        { R"(^da\b)"_r,                    "drop all" },
+        { R"(^put(.*)\b(in|into|to)\b)"_r, "drop$1in" },
+        { R"(\busing\b)"_r,                "with"     },
+        { R"(\bwith my\b)"_r,              "with"     },
+        { R"(^\s+)"_r,                     ""         },
+        { R"(\s+$)"_r,                     ""         }
+    };
+    for(;;)
+    {
+        std::string orig_cmd = cmd;
+        for(const auto& r: substitutions)
+            cmd = std::regex_replace(cmd, r.first, r.second);
+        if(cmd == orig_cmd) break;
+    }
+}
+
+// Read commands with a CommandReader, from a file (which may be a pipe)
+// or a million random ones, and check that the aliases in them are
+// rewritten as the regular expressions would have.
+static int Aliases(const char* filename)
+{
+    std::vector<std::string> corpus;
+    if(filename)
+    {
+        std::ifstream f(filename);
+        for(std::string line; std::getline(f, line); ) corpus.push_back(line);
+    }
+    else
+    {
+        static const char* const words[] =
+            { "l","la","lat","li","lin","look","in","at","all","ga","da","d","g","take","pry",
+              "i","inv","inventory","put","into","to","using","with","my","mylar","shirt",
+              "chest","cart","2","_","-","lx","puts","tomy" };
+        static const char* const separators[] =
+            { " "," "," "," ","  ","\t","\r","\n",","," \v","" };
+        std::mt19937 gen(1);
+        while(corpus.size() < 1000000)
+        {
+            std::string c;
+            for(unsigned k = gen() % 7; k-- > 0; )
+                c += (gen() % 2 ? words[gen() % count(words)] : separators[gen() % count(separators)]);
+            corpus.push_back(c);
+        }
+    }
+
+    std::size_t differ = 0;
+    for(const auto& c: corpus)
+    {
+        std::string mine = c, theirs = c;
+        RewriteAliases(mine);
+        RegexAliases(theirs);
+        if(mine != theirs && ++differ <= 10)
+            std::cout << "Differs: \"" << c << "\" -> \"" << mine << "\", not \"" << theirs << "\"\n";
+    }
+
+    auto Time = [&](const char* what, auto&& rewrite)
+    {
+        unsigned long before = allocations;
+        auto start = std::chrono::steady_clock::now();
+        for(const auto& c: corpus) rewrite(c);
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::string report = "%-12s %7zu commands %10.0f commands/s %7.2f allocations/command\n"_f
+                             % what % corpus.size() % (corpus.size() / elapsed)
+                             % (double(allocations - before) / corpus.size());
+        std::cout << report;
+    };
+    std::string cmd;
+    Time("regex", [&](const std::string& c) { cmd = c; RegexAliases(cmd); });
+    Time("rewrite", [&](const std::string& c) { cmd = c; RewriteAliases(cmd); });
+    Term term;
+    term.buffered = true;
+    CommandReader reader(term);
+    reader.interactive = false;
+    Time("ReadCommand", [&](const std::string& c)
+    {
+        // Repeat counts would only repeat the commands.
+        reader.Feed(c);
+        reader.repeat.second = 0;
+        while(reader.ReadCommand(cmd)) {}
+        term.buffer.clear();
+    });
+    std::string report = "%zu commands checked, %zu differ\n"_f % corpus.size() % differ;
+    std::cout << report;
+    return differ != 0;
+}
+
+// ListWithCounts() as it was, with the counts in an ordered map and the
+// duplicates erased one at a time.
+static std::string MapListWithCounts(ScratchList&& items, bool oneliner=true)
+{
+    std::pmr::map<ScratchString, unsigned> count(&scratch.resource);
+    for(const auto& s: items) ++count[s];
+    for(size_t a=0; a<items.size(); ++a)
+    {
+        ScratchString& n = items[a];
+        auto i = count.find(n);
+        if(i->second == 1) continue;
+        if(!i->second)
+        {
+            items.erase( items.begin() + a-- );
+            continue;
+        }
+        n.erase(0, ArticleLength(n));
+        ScratchString counted(&scratch.resource), plural(&scratch.resource);
+        if(i->second <= 12) counted = Numerals1to12[i->second-1];
+        else                counted = std::to_string(i->second);
+        counted.append(" ").append(n);
+        AppendPlural(plural, counted);
+        n.swap(plural);
+        i->second = 0;
+    }
+    std::string output;
+    for(std::size_t a=0; a<items.size(); ++a)
+        if(oneliner)
+        {
+            if(a) output += (a+1==items.size()) ? ", and " : ", ";
+            output += items[a];
+        }
+        else
+            output.append(items[a]).append("\n");
+    return output;
+}
+
+// List n names of items, most of them the same few ones, as after
+// getting everything in a room full of loot. Check that the list is
+// the same as it used to be, and time making it.
+static int Counts(std::size_t n)
+{
+    std::mt19937 gen(1);
+    auto Names = [&](std::size_t n, std::size_t kinds)
+    {
+        ScratchList names(&scratch.resource);
+        while(names.size() < n)
+        {
+            // A few of them are of any kind at all.
+            std::size_t k = gen() % 8 ? gen() % kinds : gen();
+            std::string name = "a %s %s %s"_f % CondTypes[k % count(CondTypes)].name
+                                             % BuildTypes[k / count(CondTypes) % count(BuildTypes)].name
+                                             % ItemTypes[k / count(CondTypes) / count(BuildTypes) % count(ItemTypes)].name;
+            names.emplace_back(name);
+        }
+        return names;
+    };
+
+    std::size_t differ = 0;
+    for(unsigned test=0; test<1000; ++test)
+    {
+        {
+            auto names = Names(gen() % 40, 1 + gen() % 20);
+            for(bool oneliner: { true, false })
+                if(ListWithCounts(ScratchList(names, &scratch.resource), oneliner)
+                != MapListWithCounts(ScratchList(names, &scratch.resource), oneliner))
+                    ++differ;
+        }
+        scratch.resource.release();
+    }
+
+    for(std::size_t kinds: { 10, 100, 1000 })
+    {
+        double time[2] = { 0, 0 };
+        for(int rep=0; rep<10; ++rep)
+            for(bool old: { false, true })
+            {
+                {
+                    auto names = Names(n, kinds);
+                    auto start = std::chrono::steady_clock::now();
+                    std::string list = old ? MapListWithCounts(std::move(names)) : ListWithCounts(std::move(names));
+                    time[old] += std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now() - start).count() / 10;
+                }
+                scratch.resource.release();
+            }
+        std::string report = "%zu names of mostly %4zu kinds: map %8.3f ms, hash %8.3f ms\n"_f
+                             % n % kinds % time[1] % time[0];
+        std::cout << report;
+    }
+    std::string report = "2000 short lists checked, %zu differ\n"_f % differ;
+    std::cout << report;
+    return differ != 0;
+}
+
+// Time what the game does with a pile of n items: put them in front of
+// each other one at a time (as in RoomContents() and Put()), find the
+// burden of carrying them on every step, and move them all at once.
+// For comparison, the same items are put in front of each other in a
+// plain vector, as they were before ItemList, and their worth is
+// summed from the items and from a separate column of their kinds,
+// which is what keeping the attributes in columns would give.
+static int Items(std::size_t n)
+{
+    using clock = std::chrono::steady_clock;
+    auto Elapsed = [](clock::time_point since) { return std::chrono::duration<double,std::milli>(clock::now() - since).count(); };
+    std::mt19937 rnd(1);
+    std::vector<ItemType> items;
+    while(items.size() < n) items.emplace_back(rnd);
+
+    Eq eq;
+    auto start = clock::now();
+    for(const auto& i: items) eq.push_front(i);
+    double push = Elapsed(start);
+
+    // The vector takes quadratic time, so it is only given some of the items.
+    std::size_t some = std::min(n, std::size_t(20000));
+    std::vector<ItemType> front;
+    start = clock::now();
+    for(std::size_t k=0; k<some; ++k) front.insert(front.begin(), items[k]);
+    double vector_push = Elapsed(start);
+
+    // Without NDEBUG, every step also checks the totals by counting them again.
+#ifdef NDEBUG
+    const int steps = 1000000;
+#else
+    const int steps = 100;
+#endif
+    long burden = 0;
+    start = clock::now();
+    for(int s=0; s<steps; ++s) { burden += eq.burden(); eq.Money[0] += s & 1; }
+    double step = Elapsed(start) * 1e6 / steps;
+
+    double sum = 0;
+    start = clock::now();
+    for(const auto& i: eq.Items) sum += kind_table.value[i.kind()];
+    double recount = Elapsed(start);
+    std::vector<std::uint16_t> kinds;
+    for(const auto& i: eq.Items) kinds.push_back(i.kind());
+    double column_sum = 0;
+    start = clock::now();
+    for(auto k: kinds) column_sum += kind_table.value[k];
+    double column = Elapsed(start);
+
+    Eq target;
+    double moves = 0;
+    for(int round=0; round<2; ++round)
+    {
+        {
+            start = clock::now();
+            auto moved = (round ? target : eq).move(round ? eq : target, ItemReference("all"));
+            moves += Elapsed(start) / 2;
+        }
+        scratch.resource.release();
+    }
+
+    bool ok = eq.Items.size() == n && std::equal(eq.Items.begin(), eq.Items.end(), items.rbegin(),
+                  [](const ItemType& a, const ItemType& b) { return a.kind() == b.kind(); })
+           && std::abs(sum - column_sum) <= 1e-6 * sum && burden > 0;
+    std::string report =
+        "%7zu items: put in front %8.3f ms (vector: %zu items %8.1f ms), burden %6.1f ns/step,"
+        " sum %7.3f ms (column %7.3f ms), move all %8.1f ms%s\n"_f
+        % n % push % some % vector_push % step % recount % column % moves % (ok ? "" : ", WRONG");
+    std::cout << report;
+    return !ok;
+}
+
+// Appraise() as it was, decrypting names and starting over for every
+// food that it picks.
+static std::string GotoAppraise(double value, int v=1, std::size_t maxi=3)
+{
+    ScratchList list(&scratch.resource); redo:
+    for(const auto& f: FoodTypes)
+        if(value >= f.worth)
+        {
+            auto& k = list.emplace_back(f.name);
+            for(auto& c: k) if(c-' ') c=1+((c-1)^v);
+            value -= f.worth;
+            if(list.size() < maxi) goto redo;
+            break;
+        }
+    if(list.empty()) return "nothing at all";
+    return ListWithCounts( std::move(list) );
+}
 
-    // The main loop.
-    Look();
-    while(life > 0)
+// Check that Appraise() gives what it used to for all kinds of values,
+// and time both with values such as items and inventories have.
+static int Appraisals()
+{
+    std::vector<double> values = { -1, 0, 0.5, 0.999999, 1e300, -1e300, std::nan(""), INFINITY, -INFINITY };
+    for(double v = 0; v <= 200000; v += 1) { values.push_back(v); values.push_back(v + 0.75); values.push_back(std::nextafter(v, -1.0)); }
+    std::mt19937 gen(1);
+    for(int n=0; n<100000; ++n) values.push_back(std::uniform_real_distribution<>(0, 1e6)(gen));
+
+    std::size_t differ = 0;
+    for(double v: values)
     {
-        cmd.SetPrompt( "[life:%ld]> "_f % life );
+        for(std::size_t maxi: { 0, 1, 2, 3, 5 })
+            if(Appraise(v, maxi) != GotoAppraise(v, 1, maxi) && ++differ <= 10)
+                std::cout << std::string("Differs: %g, %zu: %s\n"_f % v % maxi % Appraise(v, maxi));
+        scratch.resource.release();
+    }
 
-        auto s = cmd.ReadCommand();
-        // Produce the prompt and wait for player's command.
-        if(s == "quit") break;
-        if(s.empty()) continue;
+    std::vector<double> worths;
+    for(int n=0; n<1000000; ++n) worths.push_back(std::exponential_distribution<>(1/300.)(gen));
+    for(bool old: { true, false })
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::size_t length = 0;
+        for(std::size_t n=0; n<worths.size(); ++n)
+        {
+            length += (old ? GotoAppraise(worths[n], 1, n%2 ? 3 : 1) : Appraise(worths[n], n%2 ? 3 : 1)).size();
+            scratch.resource.release();
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::string report = "%-8s %zu appraisals: %7.3f us/appraisal (%zu characters)\n"_f
+                             % (old ? "goto" : "tables") % worths.size() % (elapsed * 1e6 / worths.size()) % length;
+        std::cout << report;
+    }
+    std::string report = "%zu values checked, %zu differ\n"_f % (values.size() * 5) % differ;
+    std::cout << report;
+    return differ != 0;
+}
 
-        // Parse the command using C++11 regex.
-        std::smatch res;
+// Eq::move() as it was, moving one item at a time after copying both
+// lists of items, and copying them back to undo a move that failed.
+static Eq::moveresult CopyingMove(Eq& me, Eq& target, const ItemReference& what)
+{
+    Eq::moveresult result;
+    Eq target_backup = target, me_backup = me;
+    for(const auto& w: what.refs)
+    {
+        bool found_item=false, found_money=false, all = !w.index;
+        for(int round=1; round<=2; ++round)
+        {
+            long remaining_items = w.amount ? w.amount : 1;
+            for(long item_id=0; (item_id = me.find_item(w, item_id)) >= 0; )
+            {
+                if(round == 2)
+                {
+                    std::string name = AddArticle(me.Items[item_id].name(0,1));
+                    if(me.Items[item_id].immovable())
+                    {
+                        result.immovable.emplace_back(name);
+                        ++item_id;
+                    }
+                    else
+                    {
+                        result.moved.emplace_back(name);
+                        target.push_front(me.Items[item_id]);
+                        me.erase(item_id);
+                    }
+                }
+                else
+                    ++item_id;
+                found_item = true;
+                if(!all && --remaining_items <= 0) break;
+            }
+            if(round == 1 && found_item && !all && remaining_items > 0)
+            {
+                found_item = false;
+                break;
+            }
+        }
+        for(int round=1; round<=2; ++round)
+        {
+            long remaining_money = w.amount ? w.amount : 0x7FFFFFFFl;
+            for(long money_id=0; (money_id = me.find_money(w, money_id)) >= 0; )
+            {
+                long get_money = std::min(remaining_money, me.Money[money_id]);
+                if(get_money <= 0) break;
+                if(round == 2)
+                {
+                    result.moved.emplace_back( std::string("%ld %s %s"_f
+                                               % get_money
+                                               % MoneyTypes[money_id].name
+                                               % (get_money==1 ? "coin" : "coins")) );
+                    target.Money[money_id] += get_money;
+                    me.Money[money_id] -= get_money;
+                }
+                else
+                    ++money_id;
+                found_money = true;
+                remaining_money -= get_money;
+                if(!all && (!w.amount || remaining_money <= 0)) break;
+            }
+            if(round == 1 && found_money && w.amount && !all && remaining_money > 0)
+            {
+                found_money = false;
+                break;
+            }
+        }
+        if(!found_item && !found_money && !what.everything)
+            result.notfound.emplace_back(w.what);
+    }
+    if(!what.except.empty())
+    {
+        ItemReference takeback("");
+        takeback.refs = what.except;
+        auto r = CopyingMove(target, me, takeback);
+        for(const auto& s: r.notfound) result.notfound.push_back(s);
+        std::set<std::string_view> m(r.moved.begin(), r.moved.end());
+        result.moved.erase(
+            std::remove_if(result.moved.begin(), result.moved.end(),
+                [&m](const ScratchString& s) { return m.find(s) != m.end(); }),
+            result.moved.end());
+        std::set<std::string_view> i(r.immovable.begin(), r.immovable.end());
+        result.immovable.erase(
+            std::remove_if(result.immovable.begin(), result.immovable.end(),
+                [&i](const ScratchString& s) { return i.find(s) != i.end(); }),
+            result.immovable.end());
+    }
+    if(!result.notfound.empty()) result.moved.clear();
+    if(result.moved.empty())
+    {
+        std::swap(target, target_backup);
+        std::swap(me, me_backup);
+    }
+    return result;
+}
+
+// Make random moves between random lists of items with both versions of
+// Eq::move(), and compare what they say and where everything ends up.
+// Then time picking up everything in rooms of many items, and picking up
+// something that is not there, which moves nothing.
+static int Moves()
+{
+    static const char* const references[] =
+        { "all","shirt","shirts","all shirts","2 shirts","shirt 2","gold","coins","3 gold coins",
+          "all except shirt","all except all shirts","all except gold","shirt, cap and tie","cap","caps",
+          "all caps","chest","cart","all except chest","shoe, shirt","12 coins","money","all except coins",
+          "iron shirt","shirt except shirt","all except x","2 caps except cap","all shirts except shirt 2",
+          "x","3 shoes","bracelets","all except shirts, caps" };
+    auto Describe = [](const Eq& eq)
+    {
+        std::string result;
+        for(const auto& i: eq.Items) result += "%u%s,"_f % i.kind() % (i.cart ? "*" : "");
+        for(long m: eq.Money) result += "%ld;"_f % m;
+        return result + "%.3f"_f % eq.items_value;
+    };
+    auto Said = [](const Eq::moveresult& r)
+    {
+        std::string result;
+        for(const auto* list: { &r.moved, &r.notfound, &r.immovable })
+        {
+            for(const auto& s: *list) result.append(s).append("|");
+            result += "#";
+        }
+        return result;
+    };
+
+    std::mt19937 rnd(7);
+    std::size_t checked = 0, moved = 0, differ = 0;
+    for(int test=0; test<20000; ++test)
+    {
+        {
+            Eq a, b;
+            a.clear(rand(9), rnd);
+            b.clear(rand(5), rnd);
+            for(auto& m: a.Money) if(rand(3) == 0) m = rand(20);
+            for(auto& m: b.Money) if(rand(4) == 0) m = rand(5);
+            if(rand(5) == 0) { ItemType i(rnd); i.chest = 1.f; a.push_front(i); }
+            if(rand(9) == 0) { ItemType i(rnd); i.cart.reset(new Eq); a.push_front(i); }
+            ItemReference what(references[rand(count(references))]);
+            Eq old_a = a, old_b = b;
+            auto said = Said(a.move(b, what)), old_said = Said(CopyingMove(old_a, old_b, what));
+            ++checked;
+            if(said.compare(0, 2, "|#") != 0 && said[0] != '#') ++moved;
+            if((said != old_said || Describe(a) != Describe(old_a) || Describe(b) != Describe(old_b))
+            && ++differ <= 10)
+                std::cout << "Differs: \"" << what.original << "\"\n";
+        }
+        scratch.resource.release();
+    }
+
+    for(const char* what: { "all", "all shirts, x" })
+        for(std::size_t n: { 1000, 10000, 40000 })
+        {
+            double time[2];
+            for(bool old: { true, false })
+            {
+                {
+                    Eq room, inv;
+                    room.clear(n, rnd);
+                    inv.clear(100, rnd);
+                    auto start = std::chrono::steady_clock::now();
+                    auto result = old ? CopyingMove(room, inv, what) : room.move(inv, what);
+                    time[old] = std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now() - start).count();
+                }
+                scratch.resource.release();
+            }
+            std::string report = "get %-13s %6zu items: copying %9.2f ms, planned %9.2f ms\n"_f
+                                 % what % n % time[1] % time[0];
+            std::cout << report;
+        }
+    std::string report = "%zu moves checked (%zu moved something), %zu differ\n"_f % checked % moved % differ;
+    std::cout << report;
+    return differ != 0;
+}
+
+// Regular expressions taken from the registry (see Regex()), or
+// compiled every time that they are used, as they were before it.
+struct Registered
+{
+    static const std::regex& Get(std::string_view pattern) { return Regex(pattern); }
+};
+struct Compiled
+{
+    static std::regex Get(std::string_view pattern) { return std::regex(pattern.begin(), pattern.end()); }
+};
 
-        #define rm std::regex_match
-
-        // First, some metacommands
-        if(s == "!?" || s == "history")     cmd.PrintHistory();
-        else if(rm(s, R"((?:help|what|\?))"_r)) goto help;
-
-        // Some fundamental movement commands
-        else if(rm(s, "((go|walk|move) +)?(n|north)"_r)) { if(TryMoveBy( 0,-1)) Look(); }
-        else if(rm(s, "((go|walk|move) +)?(s|south)"_r)) { if(TryMoveBy( 0, 1)) Look(); }
-        else if(rm(s, "((go|walk|move) +)?(w|west)"_r))  { if(TryMoveBy(-1, 0)) Look(); }
-        else if(rm(s, "((go|walk|move) +)?(e|east)"_r))  { if(TryMoveBy( 1, 0)) Look(); }
-        else if(rm(s, "((go|walk|move) +)?(nw|northwest)"_r)) { if(TryMoveBy(-1,-1)) Look(); }
-        else if(rm(s, "((go|walk|move) +)?(ne|northeast)"_r)) { if(TryMoveBy( 1,-1)) Look(); }
-        else if(rm(s, "((go|walk|move) +)?(sw|southwest)"_r)) { if(TryMoveBy(-1, 1)) Look(); }
-        else if(rm(s, "((go|walk|move) +)?(se|southeast)"_r)) { if(TryMoveBy( 1, 1)) Look(); }
-
-        // Then commands for looking at things.
-        // Use the power of regex to recognize complex syntax.
-        else if(rm(s, "look( +around)?"_r)) Look();
-        else if(rm(s, res, "look(?: +at)? +(.*?)(?: +in +(.+))?"_r)) LookAt(res[1].str(), res[2].str());
-
-        // A command for opening chests, possibly with some implements
-        else if(rm(s, res, "open +(.+?)(?: +with +(.+))?"_r))       Open(res[1].str(), res[2].str());
-        else if(rm(s, "open|get|drop"_r))                           term << "%s what?\n"_f % s;
-
-        // Inventory manipulation commands
-        else if(s == "inv")                                         Inv();
-        else if(rm(s, res, "get +(.+?)(?: +from +(.+))?"_r))        Get(res[1].str(), res[2].str());
-        else if(rm(s, res, "drop +(.+?)(?: +(?:to|in) +(.+))?"_r))  Put(res[1].str(), res[2].str());
-
-        else if(rm(s, res, "ansi +(off|on)"_r))  term.EnableDisable(res[1]=="on");
-        else if(rm(s, R"((?:wear|wield|eq)\b.*)"_r))
-            term << "You are scavenging for survival and not playing an RPG character.\n";
-        else if(rm(s, R"(eat\b.*)"_r))
-            term << "You have nothing edible! You are hoping to collect something you can sell for food.\n";
-        else if(rm(s, R"(pull\b.*)"_r))
-            { term << "Ok, you will pull any cart with you when you move. Type 'stop' to stop pulling.\n"; pulling = true; }
-        else if(s == "stop")
-            { term << "Ok, you will leave carts alone.\n"; pulling = false; }
-
-        // Any unrecognized command.
-        else term << "what?\n";
+// The English word functions as they were written with regular
+// expressions, to check the ones above against.
+template<typename Patterns = Registered>
+struct RegexWords
+{
+    static std::string RemoveArticle(const std::string& s)
+    {
+        return std::regex_replace(s, Patterns::Get("^(?:a|an|the) +"), "");
+    }
+    static std::string Pluralize(const std::string& s)
+    {
+        auto temp = std::regex_replace(s, Patterns::Get(R"(^(.*?)( (?:\(|of\b|made of\b).*)?$)"), "$1" "\001" "$2");
+        auto EndsWith = [&](const std::string& e) { return std::regex_search(temp, Patterns::Get("(?:" + e + ")\001")); };
+        auto Replace  = [&](const std::string& e, const char* with)
+            { return std::regex_replace(temp, Patterns::Get("(?:" + e + ")\001"), with); };
+        return EndsWith("s")       ? temp
+             : EndsWith("y")       ? Replace("y",   "ies")
+             : EndsWith("o|sh|ss") ? Replace("",    "es")
+             : EndsWith("ff?")     ? Replace("ff?", "ves")
+             :                       Replace("",    "s");
+    }
+    static std::string AddArticle(const std::string& s, bool definite = false)
+    {
+        std::string p = RemoveArticle(s);
+        if(definite) return "the " + p;
+        if(p == Pluralize(p)) return p;
+        return (std::regex_search(p, Patterns::Get("^[aeiou]")) ? "an ":"a ") + p;
     }
+};
 
-    // By mercy, get all from cart.
-    if(pulling) Get("all", "all cart");
+// Every name that an item or money can have, with and without the
+// articles and counts that lists put in front of them, and random
+// strings made of the parts that the word functions look for.
+static std::vector<std::string> WordSamples(std::size_t random)
+{
+    std::vector<std::string> names;
+    auto AddNames = [&](const ItemType& i)
+    {
+        for(int cond=0; cond<3; ++cond)
+            for(int mat=0; mat<3; ++mat)
+                names.push_back(i.name(cond, mat));
+    };
+    for(std::size_t t=0; t<count(ItemTypes); ++t)
+        for(std::size_t b=0; b<count(BuildTypes); ++b)
+            for(std::size_t c=0; c<count(CondTypes); ++c)
+                AddNames(ItemType(t, b, c));
+    for(float chest: { 0.2f, 0.5f, 1.0f })
+    {
+        ItemType i(0, 0, 0);
+        i.chest = chest;
+        AddNames(i);
+    }
+    std::mt19937 rnd(1);
+    for(std::size_t n: { 0, 1, 2, 13 })
+    {
+        ItemType i(0, 0, 0);
+        i.cart.reset(new Eq);
+        i.cart->clear(n, rnd);
+        AddNames(i);
+    }
+    for(const auto& m: MoneyTypes)
+        for(const char* suffix: { "", " coin", " coins" })
+            names.push_back(m.name + std::string(suffix));
+    const std::size_t all = names.size();
+    for(std::size_t n = 0; n < all; ++n)
+        for(const char* before: { "a ", "an ", "the ", "the  ", "a", "two ", "twelve ", "13 " })
+            names.push_back(before + names[n]);
+
+    static const char letters[] = "aefhosy o(ftmd_-";
+    static const char* const words[] = { "a","an","the","of","made of","(","staff","wolf","dish"," ","y","s","potato","x" };
+    for(std::size_t n = 0; n < random; ++n)
+    {
+        std::string s;
+        for(unsigned k = rand(12); k > 0; --k) s += letters[rand(count(letters)-1)];
+        names.push_back(s);
+        s.clear();
+        for(unsigned k = rand(5); k > 0; --k) s += (s.empty() ? "" : " ") + std::string(words[rand(count(words))]);
+        names.push_back(s);
+    }
+    return names;
+}
 
-    float value = eq.value();
+// Check the word functions against the regular expressions that they
+// replaced, on every name in WordSamples(), and time both.
+static int Inflect()
+{
+    auto names = WordSamples(100000);
+    std::size_t differ = 0;
+    for(const auto& s: names)
+    {
+        std::string plural;
+        AppendPlural(plural, s);
+        bool same = RegexWords<>::Pluralize(s) == plural
+                 && RegexWords<>::RemoveArticle(s) == RemoveArticle(s)
+                 && RegexWords<>::AddArticle(s) == AddArticle(s)
+                 && RegexWords<>::AddArticle(s, true) == AddArticle(s, true);
+        if(!same && ++differ <= 10) std::cout << "Differs: \"" << s << "\"\n";
+    }
 
-    term
-        << "`alert`%s\n"_f % (life<0
-            ? "You are pulled out from the maze by a supernatural force!"
-            : "byebye")
-        << "[life:%ld] Game over\n`reset`"_f % life
-        << "You managed to collect stuff worth %.2f gold.\n"_f % value
-        << "With all your possessions, you purchase %s.\n"
-           "You consume your reward eagerly.\n"_f % Appraise(value)
-        << "YOU %s\n"_f
-        % (value<10000.0
-            ? "DID NOT SURVIVE. Hint: Learn to judge the value/weight ratio."
-            : "SURVIVED! CONGRATULATION. ;)");
+    // The names of items, as the game uses them most.
+    std::vector<std::string> items;
+    for(std::size_t t=0; t<count(ItemTypes); ++t)
+        for(std::size_t b=0; b<count(BuildTypes); ++b)
+            items.push_back(ItemType(t, b, (t+b) % count(CondTypes)).name(0, 1));
+    for(bool old: { true, false })
+    {
+        std::size_t calls = 0, length = 0;
+        std::string buffer;
+        auto start = std::chrono::steady_clock::now();
+        for(int rep=0; rep<20; ++rep)
+            for(const auto& s: items)
+            {
+                if(old) length += RegexWords<>::Pluralize(s).size() + RegexWords<>::AddArticle(s).size();
+                else
+                {
+                    buffer.clear();
+                    AppendPlural(buffer, s);
+                    AppendWithArticle(buffer, s);
+                    length += buffer.size();
+                }
+                calls += 2;
+            }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::string report = "%-7s %10.0f calls/s (%zu characters)\n"_f
+                             % (old ? "regex" : "strings") % (calls / elapsed) % length;
+        std::cout << report;
+    }
+    std::string report = "%zu names checked, %zu differ\n"_f % names.size() % differ;
+    std::cout << report;
+    return differ != 0;
+}
+
+// Time the word functions written with regular expressions, with their
+// patterns compiled every time and taken from the registry.
+static int Regexes()
+{
+    std::vector<std::string> items;
+    for(std::size_t t=0; t<count(ItemTypes); ++t)
+        for(std::size_t b=0; b<count(BuildTypes); ++b)
+            items.push_back(ItemType(t, b, (t+b) % count(CondTypes)).name(0, 1));
+    std::size_t differ = 0;
+    for(const auto& s: items)
+        if(RegexWords<Compiled>::Pluralize(s) != RegexWords<>::Pluralize(s)
+        || RegexWords<Compiled>::AddArticle(s) != RegexWords<>::AddArticle(s))
+            ++differ;
+    for(bool compiled: { true, false })
+        for(bool plural: { true, false })
+        {
+            std::size_t calls = 0, length = 0;
+            auto start = std::chrono::steady_clock::now();
+            for(int rep=0; rep<(compiled ? 20 : 200); ++rep)
+                for(const auto& s: items)
+                {
+                    length += (compiled ? (plural ? RegexWords<Compiled>::Pluralize(s) : RegexWords<Compiled>::AddArticle(s))
+                                        : (plural ? RegexWords<>::Pluralize(s)         : RegexWords<>::AddArticle(s))).size();
+                    ++calls;
+                }
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::string report = "%-10s %-8s %9.0f calls/s (%zu characters)\n"_f
+                                 % (plural ? "Pluralize" : "AddArticle") % (compiled ? "compiled" : "registry")
+                                 % (calls / elapsed) % length;
+            std::cout << report;
+        }
+    std::string report = "%zu names, %zu differ\n"_f % items.size() % differ;
+    std::cout << report;
+    return differ != 0;
 }
 
+// Hashes of what the maze generator makes, so that any change to the
+// mazes is noticed. They depend on RoomRandom, on the order in which
+// RoomContents() and Maze::Make() draw their numbers, and on how the
+// standard library turns those into distributions (these are from
+// libstdc++). When a change is meant to make other mazes, the hashes
+// that it prints are to be recorded here.
+static std::uint64_t Hash(std::uint64_t h, std::uint64_t value)
+{
+    return RoomRandom::Mix(h ^ value) + value;
+}
+static std::uint64_t HashItems(std::uint64_t h, const Eq& eq)
+{
+    h = Hash(h, eq.Items.size());
+    for(const auto& i: eq.Items)
+    {
+        std::uint32_t chest;
+        std::memcpy(&chest, &i.chest, sizeof(chest));
+        h = Hash(Hash(Hash(Hash(h, i.type), i.build), i.condition), chest);
+        h = Hash(h, bool(i.cart));
+        if(i.cart) h = HashItems(h, *i.cart);
+    }
+    for(long m: eq.Money) h = Hash(h, m);
+    return h;
+}
+static int Rooms()
+{
+    struct Pinned { const char* what; std::uint64_t expected, got; };
+    std::vector<Pinned> pinned;
+
+    // The numbers drawn for a few rooms.
+    std::uint64_t h = 0;
+    for(long y=-2; y<=2; ++y)
+        for(long x=-2; x<=2; ++x)
+            for(unsigned stream=0; stream<3; ++stream)
+            {
+                RoomRandom rnd(x,y, stream);
+                for(int n=0; n<4; ++n) h = Hash(h, rnd());
+            }
+    pinned.push_back({ "RoomRandom", 0xb19fc264a550e6a9ull, h });
+
+    // The contents of rooms, which do not depend on each other.
+    h = 0;
+    for(long y=-64; y<64; ++y)
+        for(long x=-64; x<64; ++x)
+            h = HashItems(h, RoomContents(x,y));
+    pinned.push_back({ "RoomContents", 0xd88d66563e553b49ull, h });
+
+    // The chunks made as a player walks around. The walls and the
+    // environment of rooms depend on the rooms made before them.
+    Game game(false);
+    game.Output();
+    game.maze.budget = 0;
+    static const char* const steps[] = { "n","s","e","w","ne","nw","se","sw" };
+    std::mt19937 gen(1);
+    for(int n=0; n<2000; ++n)
+    {
+        game.life = 1000;
+        game.Command(steps[gen() % count(steps)]);
+    }
+    std::vector<std::uint64_t> keys;
+    game.maze.chunks.ForEach([&](std::uint64_t key, const Chunk&) { keys.push_back(key); });
+    std::sort(keys.begin(), keys.end());
+    h = Hash(Hash(Hash(0, keys.size()), game.x), game.y);
+    for(auto key: keys)
+    {
+        const Chunk& chunk = *game.maze.chunks.Find(key);
+        h = Hash(h, key);
+        for(unsigned c=0; c<Chunk::Cells; ++c)
+            if(chunk.Generated(c))
+            {
+                h = Hash(Hash(Hash(Hash(h, c), chunk.Wall[c]), chunk.Env[c]), chunk.seed[c]);
+                if(chunk.Stored(c)) h = HashItems(h, chunk.rooms.find(c)->second.items);
+            }
+    }
+    pinned.push_back({ "Maze", 0xcd5bf7abb14cc7d8ull, h });
+
+    int differ = 0;
+    for(const auto& p: pinned)
+    {
+        std::string report = "%-12s %016llx %s\n"_f
+                             % p.what % (unsigned long long)p.got
+                             % (p.got == p.expected ? "as expected" : "DIFFERS");
+        std::cout << report;
+        differ += p.got != p.expected;
+    }
+    return differ != 0;
+}
+
+// Eq::find_money() as it was, with a regular expression for each type
+// of coins.
+static long RegexFindMoney(const Eq& eq, const ItemReference::SingleReference& w, std::size_t first=0)
+{
+    for(std::size_t m = first; m < count(MoneyTypes); ++m)
+        if(eq.Money[m] > 0
+        && std::regex_match(w.what,
+            Regex( ("|money|coins?|%s( coins?)?"_f % MoneyTypes[m].name).str() )
+                           )) return m;
+    return -1;
+}
+
+// Check that find_money() accepts every name of money that it used to,
+// and nothing else, with any coins at hand. Then time both ways of
+// looking for money.
+static int Money()
+{
+    std::vector<std::string> names = { "", "money", "coin", "coins" };
+    for(const auto& m: MoneyTypes)
+        for(const char* suffix: { "", " coin", " coins" })
+            names.push_back(m.name + std::string(suffix));
+    const std::size_t accepted = names.size();
+    // And some that are not quite those.
+    for(std::size_t n = 0; n < accepted; ++n)
+        for(const char* change: { "s", " ", "x", " coin", "coins " })
+        {
+            names.push_back(names[n] + change);
+            names.push_back(change + names[n]);
+        }
+    for(const char* other: { "Gold", "gold  coins", "gold coinss", "moneys", "coins gold", "platinum gold",
+                             "shirt", "iron", "all", "gold shirt", "gol", "coi", "gold\ncoins" })
+        names.push_back(other);
+
+    std::size_t checked = 0, differ = 0;
+    Eq eq;
+    for(unsigned have = 0; have < 1u << count(MoneyTypes); ++have)
+    {
+        for(std::size_t m = 0; m < count(MoneyTypes); ++m) eq.Money[m] = have >> m & 1;
+        for(const auto& name: names)
+        {
+            ItemReference::SingleReference w;
+            w.what = name;
+            for(std::size_t first = 0; first <= count(MoneyTypes); ++first, ++checked)
+                if(eq.find_money(w, first) != RegexFindMoney(eq, w, first) && ++differ <= 10)
+                    std::cout << "Differs: \"" << name << "\"\n";
+        }
+    }
+
+    for(std::size_t m = 0; m < count(MoneyTypes); ++m) eq.Money[m] = 1;
+    for(bool old: { true, false })
+    {
+        long found = 0;
+        const int reps = 2000;
+        auto start = std::chrono::steady_clock::now();
+        for(int rep=0; rep<reps; ++rep)
+            for(const auto& name: names)
+            {
+                ItemReference::SingleReference w;
+                w.what = name;
+                for(long m=0; (m = old ? RegexFindMoney(eq, w, m) : eq.find_money(w, m)) >= 0; ++m) ++found;
+            }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::string report = "%-6s %zu names: %7.3f us/name (%ld found)\n"_f
+                             % (old ? "regex" : "index") % names.size() % (elapsed * 1e6 / reps / names.size()) % found;
+        std::cout << report;
+    }
+    std::string report = "%zu names (%zu accepted), %zu lookups checked, %zu differ\n"_f
+                         % names.size() % accepted % checked % differ;
+    std::cout << report;
+    return differ != 0;
+}
+
+#ifdef __linux__
+// Have one player, who never runs out of life, wander far away while
+// the maze keeps at most "budget" chunks in memory. The checksum of
+// everything printed must not depend on the budget.
+static int Paging(std::size_t budget, std::size_t n)
+{
+    Game game(false);
+    game.maze.budget = budget;
+    std::uint64_t checksum = std::hash<std::string>{}(game.Output());
+    auto commands = RandomCommands(1, n);
+    // Long strides in random directions, so that chunks are left and found again.
+    static const char* const far[] = { "9 n","9 s","9 e","9 w","9 ne","9 nw","9 se","9 sw" };
+    std::mt19937 gen(1);
+    auto start = std::chrono::steady_clock::now();
+    for(std::size_t c=0; c<n; ++c)
+    {
+        game.life = 1000;
+        checksum = checksum * 31 + std::hash<std::string>{}(game.Command(c%3 ? commands[c] : far[gen() % count(far)]));
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    std::string report =
+        "budget %zu: %zu commands %9.0f commands/s  at %+ld,%+ld  %zu chunks in memory  %lu put away  %lu brought back"
+        "  %ld kB on disk (%ld kB in use)  %ld kB max RSS  checksum %016llx\n"_f
+        % budget % n % (n / elapsed) % game.x % -game.y % std::size_t(game.maze.chunks.size)
+        % game.maze.put_away % game.maze.brought_back % (game.maze.store.end / 1024) % (game.maze.store.used / 1024)
+        % usage.ru_maxrss
+        % (unsigned long long)checksum;
+    std::cout << report;
+    if(!budget) return 0;
+
+    // Then change rooms in a row of more chunks than the budget, over
+    // and over, so that every chunk is put away again after changing.
+    // The file must not grow with the number of changes, and the rooms
+    // must end up as in a maze that keeps everything in memory.
+    Maze maze, all;
+    maze.budget = budget;
+    all.budget  = 0;
+    const long width = long(budget) * 2 * long(Chunk::Size);
+    auto Same = [](const Room& a, const Room& b)
+    {
+        return a.items.Items.size() == b.items.Items.size()
+            && std::equal(a.items.Items.begin(), a.items.Items.end(), b.items.Items.begin(),
+                          [](const ItemType& i, const ItemType& j) { return i.kind() == j.kind(); });
+    };
+    const char* const differ = "The rooms that were put away differ!\n";
+    long most = 0;
+    for(unsigned round=0; round<200; ++round)
+    {
+        long y = round % Chunk::Size;
+        for(long x=0; x<width; x += 3)
+        {
+            Room& room = maze.GenerateRoom(x,y, defaultroom, 0), &same = all.GenerateRoom(x,y, defaultroom, 0);
+            if(!Same(room, same)) { std::cout << differ; return 1; }
+            if(room.items.Items.size() > 4)
+            {
+                std::size_t n = gen() % room.items.Items.size();
+                room.items.erase(n);
+                same.items.erase(n);
+            }
+            else
+            {
+                ItemType item(gen);
+                room.items.push_front(item);
+                same.items.push_front(item);
+            }
+            maze.Modify(x,y);
+            maze.Trim();
+        }
+        most = std::max(most, maze.store.used);
+    }
+    for(long y=0; y<long(Chunk::Size); ++y)
+        for(long x=0; x<width; x += 3)
+            if(!Same(maze.GenerateRoom(x,y, defaultroom, 0), all.GenerateRoom(x,y, defaultroom, 0)))
+            {
+                std::cout << differ;
+                return 1;
+            }
+    report = "budget %zu: rooms changed 200 times over: %lu put away  %ld kB on disk (at most %ld kB in use)\n"_f
+             % budget % maze.put_away % (maze.store.end / 1024) % (most / 1024);
+    std::cout << report;
+    // Free slots take at most half of the file, and the others have
+    // room to grow by an eighth.
+    return maze.store.end > 3 * most + 65536;
+}
+
+// Save and restore a game where the contents of n rooms have changed,
+// and then look at every one of those rooms, which brings them back.
+static int Snapshots(const std::string& filename)
+{
+    for(std::size_t n: { 10000, 100000, 1000000 })
+    {
+        Game game(false);
+        game.Output();
+        game.maze.budget = 0;
+        game.maze.pregenerated.reset();
+        long side = std::lround(std::ceil(std::sqrt(double(n))));
+        std::mt19937 rnd;
+        for(std::size_t r=0; r<n; ++r)
+        {
+            long x = r % side, y = r / side;
+            game.maze.GenerateRoom(x,y, defaultroom, 0).items.push_front(ItemType(rnd));
+            game.maze.Modify(x,y);
+        }
+        using clock = std::chrono::steady_clock;
+        auto Elapsed = [](clock::time_point since) { return std::chrono::duration<double,std::milli>(clock::now() - since).count(); };
+        auto start = clock::now();
+        if(!game.Save(filename)) { std::perror(filename.c_str()); return 1; }
+        double save = Elapsed(start);
+
+        Game restored(false);
+        restored.Output();
+        start = clock::now();
+        if(!restored.Restore(filename)) { std::perror(filename.c_str()); return 1; }
+        double load = Elapsed(start);
+        start = clock::now();
+        std::size_t items = 0;
+        for(std::size_t r=0; r<n; ++r)
+            items += restored.maze.GenerateRoom(r % side, r / side, defaultroom, 0).items.Items.size();
+        double access = Elapsed(start);
+
+        std::ifstream f(filename, std::ios::binary | std::ios::ate);
+        std::string report =
+            "%7zu changed rooms: %6.1f MB  save %8.1f ms  restore %6.3f ms  every room once %8.1f ms  (%zu items)\n"_f
+            % n % (f.tellg() / 1e6) % save % load % access % items;
+        std::cout << report;
+    }
+
+    // Copies of a small game that are cut short or damaged must either
+    // be refused, or give a game that can be played.
+    Game game(false);
+    game.Output();
+    std::mt19937 rnd;
+    for(long r=0; r<64; ++r)
+    {
+        Room& room = game.maze.GenerateRoom(r % 8, r / 8, defaultroom, 0);
+        room.items.push_front(ItemType(rnd));
+        if(r % 9 == 0)
+        {
+            ItemType cart(rnd);
+            cart.cart.reset(new Eq);
+            cart.cart->push_front(ItemType(rnd));
+            cart.cart->Money[1] = 3;
+            room.items.push_front(cart);
+        }
+        game.maze.Modify(r % 8, r / 8);
+    }
+    game.eq.push_front(ItemType(rnd));
+    game.eq.Money[0] = 10;
+    if(!game.Save(filename)) { std::perror(filename.c_str()); return 1; }
+    std::string saved;
+    {
+        std::ifstream f(filename, std::ios::binary);
+        saved.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+    }
+    std::size_t refused = 0, restored = 0;
+    auto Try = [&](const std::string& data)
+    {
+        {
+            std::ofstream f(filename, std::ios::binary | std::ios::trunc);
+            f.write(data.data(), data.size());
+        }
+        Game g(false);
+        g.Output();
+        if(!g.Restore(filename)) { ++refused; return; }
+        ++restored;
+        for(long r=0; r<64; ++r) g.maze.GenerateRoom(r % 8, r / 8, defaultroom, 0);
+        g.Command("look");
+        g.Command("i");
+    };
+    for(std::size_t length=0; length<saved.size(); ++length) Try(saved.substr(0, length));
+    for(unsigned n=0; n<2000; ++n)
+    {
+        std::string data = saved;
+        for(unsigned k=0; k<=n%4; ++k) data[rnd() % data.size()] = char(rnd());
+        Try(data);
+    }
+    std::string report = "%zu bytes cut short or damaged: %zu refused, %zu restored and played\n"_f
+                         % saved.size() % refused % restored;
+    std::cout << report;
+    std::remove(filename.c_str());
+    return 0;
+}
+
+// Count the bytes that a player gets for the same commands, when the
+// map is printed in full, and when only what changed is drawn.
+static int Screen(std::size_t n)
+{
+    static const char* const steps[] = { "n","s","e","w","ne","nw","se","sw" };
+    std::vector<std::string> walk;
+    std::mt19937 gen(1);
+    while(walk.size() < n) walk.push_back(steps[gen() % count(steps)]);
+    for(const auto& test: { std::make_pair("steps", walk), std::make_pair("random", RandomCommands(1, n)) })
+    {
+        std::size_t bytes[2] = { 0, 0 };
+        for(bool screen: { false, true })
+        {
+            Game game(false);
+            game.Output();
+            if(screen) game.Command("screen on");
+            for(const auto& c: test.second)
+            {
+                game.life = 1000;
+                bytes[screen] += game.Command(c).size();
+            }
+        }
+        std::string report = "%-8s %7zu commands: full %7.1f bytes/command, screen %7.1f bytes/command (%.0f%%)\n"_f
+                             % test.first % n % (double(bytes[0]) / n) % (double(bytes[1]) / n)
+                             % (100. * bytes[1] / bytes[0]);
+        std::cout << report;
+    }
+    return 0;
+}
+
+// Render a large map of a maze where every room has been generated, and
+// compare that with looking up every room on its own, and with just
+// copying as many characters.
+static int View(std::size_t width, std::size_t height)
+{
+    Maze maze;
+    maze.budget = 0;
+    const long left = -long(width/2), top = -long(height/2);
+    for(std::size_t row = 0; row < height; ++row)
+        for(std::size_t column = 0; column < width; ++column)
+            maze.Generate(left + long(column), top + long(row), defaultroom, 0);
+    std::string map(width * height, ' '), copy(width * height, ' ');
+
+    auto Time = [&](const char* what, auto&& f)
+    {
+        f(); // Once to warm up
+        unsigned reps = 0;
+        auto start = std::chrono::steady_clock::now();
+        double elapsed;
+        do { f(); ++reps; }
+        while((elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()) < 1.0);
+        std::string report = "%-8s %zux%zu: %9.1f us/map %7.3f ns/room\n"_f
+                             % what % width % height % (elapsed * 1e6 / reps) % (elapsed * 1e9 / reps / map.size());
+        std::cout << report;
+    };
+    Time("render", [&]{ maze.Render(left, top, width, height, &map[0]); });
+    Time("rooms", [&]
+    {
+        for(std::size_t row = 0; row < height; ++row)
+            for(std::size_t column = 0; column < width; ++column)
+            {
+                long x = left + long(column), y = top + long(row);
+                const Chunk* chunk = maze.chunks.Find(Chunk::Key(x,y));
+                copy[row * width + column] = chunk ? chunk->Char(Chunk::Cell(x,y)) : ' ';
+            }
+    });
+    if(copy != map) { std::cout << "The maps differ!\n"; return 1; }
+    Time("memcpy", [&]{ std::memcpy(&copy[0], map.data(), map.size()); asm volatile("" :: "r"(copy.data()) : "memory"); });
+    std::size_t rooms = map.size() - std::count(map.begin(), map.end(), ' ');
+    std::string report = "%zu of the rooms on the map exist, in %zu chunks\n"_f % rooms % std::size_t(maze.chunks.size);
+    std::cout << report;
+    return 0;
+}
+
+// Connect as many players to a server as asked. The idle ones only
+// listen. The active ones send a random command whenever they have
+// got the answer to their previous one (and now and then, a line that
+// the server must not choke on), and start over when their game ends.
+static int Load(const std::string& address, unsigned idle, unsigned active, double seconds)
+{
+    RaiseFileLimit();
+    sockaddr_storage a; socklen_t length = 0;
+    int family = SocketAddress(address, a, length);
+    auto Connect = [&]
+    {
+        int fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&a), length) != 0) { close(fd); fd = -1; }
+        return fd;
+    };
 
+    struct Player
+    {
+        int fd = -1;
+        bool active = false;
+        std::string received;
+        std::chrono::steady_clock::time_point sent;
+    };
+    std::vector<Player> players(idle + active);
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    auto Join = [&](Player& p)
+    {
+        p.fd = Connect();
+        if(p.fd < 0) return false;
+        p.received.clear();
+        p.sent = std::chrono::steady_clock::now();
+        epoll_event ev{};
+        ev.events   = EPOLLIN;
+        ev.data.ptr = &p;
+        epoll_ctl(ep, EPOLL_CTL_ADD, p.fd, &ev);
+        return true;
+    };
+    for(std::size_t n=0; n<players.size(); ++n)
+    {
+        players[n].active = n >= idle;
+        if(!Join(players[n])) { std::perror(address.c_str()); return 1; }
+    }
+
+    auto commands = RandomCommands(1, 4096);
+    // Now and then, send lines that once brought the whole server down.
+    // If they do again, the players cannot join again, and this fails.
+    static const char* const hostile[] = { "99999999999 look", "4294967297 look", "51 n", "2147483648 inv" };
+    for(std::size_t n=0; n<commands.size(); n += 64) commands[n] = hostile[n/64 % count(hostile)];
+    std::size_t next = 0;
+    std::vector<double> latency;
+    unsigned long games = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto end   = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+    epoll_event events[256];
+    while(std::chrono::steady_clock::now() < end)
+    {
+        int n = epoll_wait(ep, events, count(events), 100);
+        for(int e=0; e<n; ++e)
+        {
+            Player& p = *static_cast<Player*>(events[e].data.ptr);
+            char buffer[65536];
+            ssize_t r = read(p.fd, buffer, sizeof(buffer));
+            if(r <= 0)
+            {
+                // The game is over. Start another.
+                close(p.fd); ++games;
+                if(!Join(p)) { std::perror(address.c_str()); return 1; }
+                continue;
+            }
+            if(!p.active) continue;
+            p.received.append(buffer, r);
+            // The answer is complete when the next prompt has arrived.
+            if(p.received.find("]> ") == p.received.npos) continue;
+            auto now = std::chrono::steady_clock::now();
+            latency.push_back( std::chrono::duration<double,std::micro>(now - p.sent).count() );
+            std::string command = commands[next++ % commands.size()] + "\n";
+            p.received.clear();
+            p.sent = now;
+            // The game may have ended right after its last prompt.
+            if(send(p.fd, command.data(), command.size(), MSG_NOSIGNAL) < 0)
+            {
+                if(errno != EPIPE && errno != ECONNRESET) { std::perror("send"); return 1; }
+                close(p.fd); ++games;
+                if(!Join(p)) { std::perror(address.c_str()); return 1; }
+            }
+        }
+    }
+    if(latency.empty()) return 1;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::sort(latency.begin(), latency.end());
+    std::string report =
+        "%u idle, %u active players: %lu commands %9.0f commands/s  p50 %7.1f us  p99 %7.1f us  %lu games ended\n"_f
+        % idle % active % latency.size() % (latency.size() / elapsed)
+        % latency[latency.size() / 2] % latency[latency.size() * 99 / 100] % games;
+    std::cout << report;
+    for(auto& p: players) close(p.fd);
+    return 0;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+#ifdef __linux__
+    if(argc >= 5 && std::string(argv[1]) == "--load")
+        return Load(argv[2], std::atoi(argv[3]), std::atoi(argv[4]), argc >= 6 ? std::atof(argv[5]) : 10.0);
+    if(argc >= 2 && std::string(argv[1]) == "--view")
+        return View(argc >= 4 ? std::atol(argv[2]) : 400, argc >= 4 ? std::atol(argv[3]) : 200);
+    if(argc >= 2 && std::string(argv[1]) == "--screen")
+        return Screen(argc >= 3 ? std::atol(argv[2]) : 20000);
+    if(argc >= 2 && std::string(argv[1]) == "--snapshot")
+        return Snapshots(argc >= 3 ? argv[2] : "dungeon_bench.sav");
+    if(argc >= 3 && std::string(argv[1]) == "--paging")
+        return Paging(std::atol(argv[2]), argc >= 4 ? std::atol(argv[3]) : 100000);
+#endif
+    if(argc >= 2 && std::string(argv[1]) == "--items")
+    {
+        if(argc >= 3) return Items(std::stoul(argv[2]));
+        int failed = 0;
+        for(std::size_t n: { 1000, 100000, 1000000 }) failed |= Items(n);
+        return failed;
+    }
+    if(argc >= 2 && std::string(argv[1]) == "--move")
+        return Moves();
+    if(argc >= 2 && std::string(argv[1]) == "--regex")
+        return Regexes();
+    if(argc >= 2 && std::string(argv[1]) == "--inflect")
+        return Inflect();
+    if(argc >= 2 && std::string(argv[1]) == "--rooms")
+        return Rooms();
+    if(argc >= 2 && std::string(argv[1]) == "--money")
+        return Money();
+    if(argc >= 2 && std::string(argv[1]) == "--appraise")
+        return Appraisals();
+    if(argc >= 2 && std::string(argv[1]) == "--counts")
+        return Counts(argc >= 3 ? std::atol(argv[2]) : 10000);
+    if(argc >= 2 && std::string(argv[1]) == "--aliases")
+        return Aliases(argc >= 3 ? argv[2] : nullptr);
+    if(argc >= 2 && std::string(argv[1]) == "--parse")
+        return Parse(argc >= 3 ? std::atol(argv[2]) : 100000);
+    if(argc >= 5 && std::string(argv[1]) == "--shared")
+        return Shared(std::atoi(argv[2]), std::max(1, std::atoi(argv[3])), std::string(argv[4]) == "crowd",
+                      argc >= 6 ? std::atof(argv[5]) : 10.0);
+    if(argc > 1)
+        for(int a=1; a<argc; ++a)
+        {
+            std::ifstream f(argv[a]);
+            std::vector<std::string> commands;
+            for(std::string line; std::getline(f, line); ) commands.push_back(line);
+            Bench(argv[a], commands);
+        }
+    else
+        for(unsigned seed=1; seed<=3; ++seed)
+            Bench("random %u"_f % seed, RandomCommands(seed, 20000));
+}
+#else
+#ifdef __linux__
+static int Serve(const std::string& address, unsigned threads, bool shared)
+{
+    Server server;
+    if(shared)
+    {
+        server.world = std::make_shared<Maze>(true);
+        server.world->pregenerated.reset();
+    }
+    if(!server.Listen(address)) { std::perror(address.c_str()); return 1; }
+    RaiseFileLimit();
+    if(!threads) threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> workers;
+    for(unsigned t=1; t<threads; ++t) workers.emplace_back([&]{ server.Work(); });
+    server.Work();
+    return 0;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+#ifdef __linux__
+    // "dungeon --listen <port or socket path> [threads] [shared]" serves
+    // games to other people instead of playing one here. With "shared",
+    // they all play in the same maze.
+    if(argc >= 3 && std::string(argv[1]) == "--listen")
+        return Serve(argv[2], argc >= 4 ? std::atoi(argv[3]) : 0,
+                     argc >= 5 && std::string(argv[4]) == "shared");
+#endif
+    (void)argc; (void)argv;
+    Game().Run();
+}
+#endif